@@ -0,0 +1,410 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libfanboy.h"
+
+const char *DEF_DEVICE = "/dev/ttyACM0";
+const char *ITEM_DELIMITER = ",";
+const int DEF_COUNT = 100;
+
+/**
+ * @brief Benchmark of a single command
+ */
+typedef struct {
+    const char  *name;          // command name as used on the command line
+    cmd_t        cmd;
+    const void  *payload;       // request payload (set up by bench_setup())
+    size_t       len;           // request payload length
+    size_t       reply_len;     // expected reply payload length
+    bool         results;       // reply consists of `msg_result_t` only
+    bool         writes;        // changes device state, only run if requested
+    bool         variable;      // reply length varies (up to `reply_len`)
+    bool         selected;
+} bench_t;
+
+/**
+ * @brief Results of a single command benchmark
+ */
+typedef struct {
+    unsigned   ok;
+    unsigned   timeouts;
+    unsigned   errors;
+    unsigned   retries;             // serial I/O calls retried
+    unsigned   discarded;           // bytes dropped resyncing on SOF
+    uint64_t   p50, p90, p99, max;  // latency (us)
+    double     rate;                // successful requests per second
+} bench_result_t;
+
+static fb_device_t       *dev = NULL;
+static fb_config_t        config;     // configuration to restore after run
+
+static msg_fan_mode_t     msg_mode;
+static msg_fan_duty_t     msg_duty;
+static msg_fan_map_t      msg_map;
+static msg_fan_linear_t   msg_linear;
+static msg_fan_points_t   msg_points;
+static msg_subscribe_t    msg_subscribe;
+static msg_period_t       msg_period;
+static msg_history_req_t  msg_history;
+static uint8_t            msg_batch[sizeof(msg_batch_t) + BATCH_LEN];
+
+// setters re-apply the current configuration of fan 1, so they do not change
+// anything apart from FAN_DUTY implying manual mode and LOAD replacing the
+// configuration by the saved one (both restored afterwards)
+static bench_t benches[] = {
+    { "version",     CMD_VERSION,     NULL, 0, sizeof(fb_version_t) },
+    { "status",      CMD_STATUS,      NULL, 0, sizeof(fb_status_t) },
+    { "config",      CMD_CONFIG,      NULL, 0, sizeof(fb_config_t) },
+    { "fan_mode",    CMD_FAN_MODE,    &msg_mode, sizeof(msg_mode),
+                     sizeof(msg_result_t), true, true },
+    { "fan_duty",    CMD_FAN_DUTY,    &msg_duty, sizeof(msg_duty),
+                     sizeof(msg_result_t), true, true },
+    { "fan_map",     CMD_FAN_MAP,     &msg_map, sizeof(msg_map),
+                     sizeof(msg_result_t), true, true },
+    { "linear",      CMD_LINEAR,      &msg_linear, sizeof(msg_linear),
+                     sizeof(msg_result_t), true, true },
+    { "points",      CMD_POINTS,      &msg_points, sizeof(msg_points),
+                     sizeof(msg_result_t), true, true },
+    { "curve_state", CMD_CURVE_STATE, NULL, 0, sizeof(fb_curve_state_t) },
+    { "curve_data",  CMD_CURVE_DATA,  NULL, 0, sizeof(fb_curve_t) },
+    { "subscribe",   CMD_SUBSCRIBE,   &msg_subscribe, sizeof(msg_subscribe),
+                     sizeof(msg_result_t), true, true },
+    { "timing",      CMD_TIMING,      NULL, 0, sizeof(fb_timing_t) },
+    { "diag",        CMD_DIAG,        NULL, 0, sizeof(fb_diag_t) },
+    { "history",     CMD_HISTORY,     &msg_history, sizeof(msg_history),
+                     UINT8_MAX, false, false, true },
+    { "period",      CMD_PERIOD,      &msg_period, sizeof(msg_period),
+                     sizeof(msg_result_t), true, true },
+    { "batch",       CMD_BATCH,       msg_batch, 0, 0, true, true },
+    { "save",        CMD_SAVE,        NULL, 0, sizeof(msg_result_t), true,
+                     true },
+    { "load",        CMD_LOAD,        NULL, 0, sizeof(msg_result_t), true,
+                     true },
+};
+
+#define NUM_BENCH  (sizeof(benches) / sizeof(bench_t))
+
+
+static inline void print_help()
+{
+    puts("Usage: fanboy-bench [ARGUMENT(S)]\n");
+
+    puts(  "Measures request latency and throughput of a FanBoy.\n");
+
+    printf("  -D DEV   Set device (default: '%s')\n", DEF_DEVICE);
+    printf("  -n NUM   No. of requests per command (default: %d)\n",
+           DEF_COUNT);
+    printf("  -p NUM   No. of requests in flight (1-8, default: 1)\n");
+    puts(  "  -c CMDS  Commands to run, comma-separated (default: all)");
+    puts(  "  -w       Include commands changing device state (setters,");
+    puts(  "           'load' and 'save', which writes EEPROM)");
+    puts(  "  -f FMT   Output format ('json' or 'csv', default: 'json')");
+    puts(  "  -h       Show usage help text\n");
+
+    puts(  "Commands:");
+    for (size_t i=0; i<NUM_BENCH; i++)
+        printf("  %s\n", benches[i].name);
+    putchar('\n');
+}
+
+static uint64_t now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static inline bool select_benches(char *string)
+{
+    for (char *ptr = strtok(string, ITEM_DELIMITER); ptr;
+            ptr = strtok(NULL, ITEM_DELIMITER)) {
+        size_t i = 0;
+        while (i < NUM_BENCH && strcmp(ptr, benches[i].name) != 0)
+            i++;
+        if (i == NUM_BENCH) {
+            fprintf(stderr, "Error: invalid command '%s'\n", ptr);
+            return false;
+        }
+        benches[i].selected = true;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Set up request payloads from current configuration
+ */
+static void bench_setup()
+{
+    const fan_config_t *fan = &config.fan[0];
+
+    msg_mode = (msg_fan_mode_t){ .fan = 0, .mode = fan->mode };
+    msg_duty = (msg_fan_duty_t){ .fan = 0, .duty = fan->duty };
+    msg_map = (msg_fan_map_t){ .fan = 0, .sensor = fan->sensor };
+    msg_linear = (msg_fan_linear_t){ .fan = 0, .param = fan->param };
+    msg_points = (msg_fan_points_t){ .fan = 0, .points = fan->points };
+    msg_subscribe = (msg_subscribe_t){ .interval = 0 };
+    msg_period = (msg_period_t){ .period = config.period };
+    // cycle no. not held (unless just booted), i.e. a full chunk of the oldest
+    msg_history = (msg_history_req_t){ .seq = 0 };
+
+    // all settings of fan 1 in one batch
+    fb_batch_t batch;
+    fb_batch_init(&batch);
+    fb_batch_set_map(&batch, 0, fan->sensor);
+    fb_batch_set_linear(&batch, 0, &msg_linear.param);
+    fb_batch_set_duty(&batch, 0, fan->duty);
+    fb_batch_set_mode(&batch, 0, fan->mode);
+
+    msg_batch_t head = { .count = batch.count, .len = batch.len };
+    memcpy(msg_batch, &head, sizeof(head));
+    memcpy(msg_batch + sizeof(head), batch.data, batch.len);
+
+    for (size_t i=0; i<NUM_BENCH; i++) {
+        if (benches[i].cmd == CMD_BATCH) {
+            benches[i].len = sizeof(head) + batch.len;
+            benches[i].reply_len = batch.count * sizeof(msg_result_t);
+        }
+    }
+}
+
+/**
+ * @brief Restore configuration possibly changed by FAN_DUTY or LOAD
+ *
+ * Covers everything LOAD replaces apart from the temperature unit, which no
+ * command sets and is thus the saved one anyway.
+ */
+static bool bench_restore()
+{
+    if (!fb_dev_set_period(dev, config.period))
+        return false;
+
+    for (uint8_t i=0; i<NUM_FAN; i++) {
+        fan_config_t *fan = &config.fan[i];
+        if (!fb_dev_set_map(dev, i, fan->sensor) ||
+                !fb_dev_set_linear(dev, i, &fan->param) ||
+                !fb_dev_set_points(dev, i, &fan->points) ||
+                !fb_dev_set_duty(dev, i, fan->duty) ||
+                !fb_dev_set_mode(dev, i, fan->mode))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Run benchmark, keeping up to `depth` requests in flight
+ */
+static void bench_run(const bench_t *bench, unsigned count, unsigned depth,
+                      bench_result_t *result)
+{
+    uint64_t *latency = calloc(count, sizeof(uint64_t));
+    uint64_t *sent = calloc(count, sizeof(uint64_t));
+    fb_request_t *ids = calloc(count, sizeof(fb_request_t));
+    uint8_t (*replies)[UINT8_MAX] = calloc(depth, UINT8_MAX);
+    size_t *received = calloc(depth, sizeof(size_t));
+
+    memset(result, 0, sizeof(bench_result_t));
+    fb_dev_stats(dev, NULL, true);
+
+    unsigned submitted = 0, done = 0, measured = 0;
+    uint64_t start = now_us();
+    while (done < count) {
+        // fill pipeline
+        while (submitted < count && submitted - done < depth) {
+            sent[submitted] = now_us();
+            bool ret;
+            if (bench->variable)
+                ret = fb_dev_submit_var(dev, bench->cmd, bench->payload,
+                                        bench->len, replies[submitted % depth],
+                                        bench->reply_len,
+                                        &received[submitted % depth],
+                                        &ids[submitted]);
+            else
+                ret = fb_dev_submit(dev, bench->cmd, bench->payload,
+                                    bench->len, replies[submitted % depth],
+                                    bench->reply_len, &ids[submitted]);
+            if (!ret)
+                ids[submitted] = 0;
+            submitted++;
+        }
+
+        // collect oldest request
+        bool ok = ids[done] && fb_dev_wait(dev, ids[done]);
+        for (size_t i=0; ok && bench->results && i<bench->reply_len; i++)
+            ok = replies[done % depth][i] == RESULT_OK;
+        if (ok) {
+            result->ok++;
+            latency[measured++] = now_us() - sent[done];
+        }
+        done++;
+    }
+    uint64_t elapsed = now_us() - start;
+
+    // failures other than missing replies are errors, @see fb_cmd_stats_t
+    static fb_stats_t stats;
+    if (fb_dev_stats(dev, &stats, false)) {
+        result->timeouts = stats.cmd[fb_stats_slot(bench->cmd)].timeouts;
+        result->retries = stats.retries;
+        result->discarded = stats.discarded;
+    }
+    result->errors = count - result->ok - result->timeouts;
+
+    if (measured) {
+        qsort(latency, measured, sizeof(uint64_t), compare_u64);
+        // nearest-rank percentiles
+        result->p50 = latency[(measured * 50 + 99) / 100 - 1];
+        result->p90 = latency[(measured * 90 + 99) / 100 - 1];
+        result->p99 = latency[(measured * 99 + 99) / 100 - 1];
+        result->max = latency[measured - 1];
+    }
+    result->rate = elapsed ? result->ok * 1000000.0 / elapsed : 0.0;
+
+    free(latency);
+    free(sent);
+    free(ids);
+    free(replies);
+    free(received);
+}
+
+static void print_result(const bench_t *bench, unsigned count,
+                         unsigned depth, const bench_result_t *result, bool csv,
+                         bool first)
+{
+    if (csv) {
+        if (first)
+            puts("command,count,depth,ok,timeouts,errors,retries,discarded,"
+                 "p50_us,p90_us,p99_us,max_us,req_per_s");
+        printf("%s,%u,%u,%u,%u,%u,%u,%u,%llu,%llu,%llu,%llu,%.1f\n",
+               bench->name, count, depth, result->ok, result->timeouts,
+               result->errors, result->retries, result->discarded,
+               (unsigned long long)result->p50,
+               (unsigned long long)result->p90,
+               (unsigned long long)result->p99,
+               (unsigned long long)result->max, result->rate);
+    } else {
+        printf("%s\n    {\"command\": \"%s\", \"count\": %u, \"depth\": %u, "
+               "\"ok\": %u, \"timeouts\": %u, \"errors\": %u, "
+               "\"retries\": %u, \"discarded\": %u, "
+               "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, "
+               "\"max_us\": %llu, \"req_per_s\": %.1f}",
+               first ? "" : ",", bench->name, count, depth, result->ok,
+               result->timeouts, result->errors, result->retries,
+               result->discarded,
+               (unsigned long long)result->p50,
+               (unsigned long long)result->p90,
+               (unsigned long long)result->p99,
+               (unsigned long long)result->max, result->rate);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEF_DEVICE;
+    unsigned count = DEF_COUNT;
+    unsigned depth = 1;
+    bool writes = false;
+    bool csv = false;
+    bool all = true;
+
+    int c;
+    while ((c = getopt(argc, argv, "D:n:p:c:wf:h")) != -1) {
+        switch (c) {
+            case 'D':
+                device = optarg;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count == 0) {
+                    fprintf(stderr, "Error: invalid count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                depth = atoi(optarg);
+                if (depth < 1 || depth > 8) {
+                    fprintf(stderr, "Error: invalid depth '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (!select_benches(optarg))
+                    return 1;
+                all = false;
+                break;
+            case 'w':
+                writes = true;
+                break;
+            case 'f':
+                if (strcmp("csv", optarg) == 0) {
+                    csv = true;
+                } else if (strcmp("json", optarg) != 0) {
+                    fprintf(stderr, "Error: invalid format '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                fprintf(stderr, "invalid argument(s). Try -h for help.\n");
+                return 1;
+        }
+    }
+
+    const char *error = NULL;
+    dev = fb_open(device, &error);
+    if (dev == NULL) {
+        fprintf(stderr, "Failed to connect to '%s': %s\n", device, error);
+        return 1;
+    }
+    if (!fb_dev_config(dev, &config)) {
+        fprintf(stderr, "Failed to read config: %s\n", fb_dev_error(dev));
+        fb_close(dev);
+        return 1;
+    }
+    bench_setup();
+
+    if (!csv)
+        printf("[");
+    bool first = true;
+    for (size_t i=0; i<NUM_BENCH; i++) {
+        const bench_t *bench = &benches[i];
+        if (!(all || bench->selected) || (bench->writes && !writes))
+            continue;
+
+        bench_result_t result;
+        bench_run(bench, count, depth, &result);
+        print_result(bench, count, depth, &result, csv, first);
+        first = false;
+    }
+    if (!csv)
+        printf("\n]\n");
+
+    bool ret = !writes || bench_restore();
+    if (!ret)
+        fprintf(stderr, "Failed to restore config: %s\n", fb_dev_error(dev));
+
+    fb_close(dev);
+
+    return !ret;
+}
@@ -5,12 +5,23 @@
  */
 
 #include <getopt.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#ifndef WIN32
+#include <time.h>
+#include <unistd.h>
+#else
+#include <Windows.h>
+#endif
  
 #include "libfanboy.h"
+#ifndef WIN32
+#include "record.h"
+#endif
 
 #if defined linux
 const char *DEF_DEVICE = "/dev/ttyACM0";
@@ -18,40 +29,119 @@ const char *DEF_DEVICE = "/dev/ttyACM0";
 const char *DEF_DEVICE = "COM1";
 #endif
 const char *PARAM_DELIMITER = ":";
+const char POINT_DELIMITER = ',';
+const int CURVE_POLL_MS = 500;
+#ifndef WIN32
+const int RECORD_INTERVAL = 500;
+
+// long options, values beyond those of short ones
+enum {
+    OPT_RECORD = 0x100,
+    OPT_DUMP,
+    OPT_FROM,
+    OPT_TO
+};
+
+static const struct option LONG_OPTS[] = {
+    { "record", required_argument, NULL, OPT_RECORD },
+    { "dump",   required_argument, NULL, OPT_DUMP   },
+    { "from",   required_argument, NULL, OPT_FROM   },
+    { "to",     required_argument, NULL, OPT_TO     },
+    { NULL,     0,                 NULL, 0          }
+};
+#else
+static const struct option LONG_OPTS[] = {
+    { NULL,     0,                 NULL, 0          }
+};
+#endif
+
+static volatile sig_atomic_t interrupted = 0;
+
+static fb_batch_t  batch;                   // pending settings
+static const char *batch_what[BATCH_LEN];   // description of each setting
 
 
 static inline const char *peek_device(int argc, char *argv[])
 {
-    for (int i=argc-2; i>=0; i--)
-        if (strcmp("-D", argv[i]) == 0)
+    for (int i=argc-1; i>=0; i--) {
+        if (i < argc-1 && strcmp("-D", argv[i]) == 0)
             return argv[i+1];
+#ifndef WIN32
+        if (strcmp("-U", argv[i]) == 0)
+            return FB_SOCKET;
+#endif
+    }
 
     return DEF_DEVICE;
 }
 
+#ifndef WIN32
+static inline bool peek_offline(int argc, char *argv[])
+{
+    // recordings are read without a device
+    static const char *offline[] = { "--dump", "--from", "--to" };
+    const size_t num = sizeof(offline) / sizeof(offline[0]);
+
+    for (int i=1; i<argc; i++) {
+        size_t o;
+        for (o=0; o<num; o++) {
+            size_t len = strlen(offline[o]);
+            if (strncmp(offline[o], argv[i], len) == 0 &&
+                    (argv[i][len] == '\0' || argv[i][len] == '='))
+                break;
+        }
+        if (o == num)
+            return false;
+        // value given as next argument
+        if (strchr(argv[i], '=') == NULL)
+            i++;
+    }
+
+    return argc > 1;
+}
+#endif
+
 static inline void print_help()
 {
     puts("Usage: fanboycli [ARGUMENT(S)]\n");
 
     puts(  "Device Status:");
     puts(  "  -s       Show current fan / sensor readings");
-    puts(  "  -c       Show current configuration\n");
+    puts(  "  -c       Show current configuration");
+    puts(  "  -T       Show control loop timing since previous query");
+    puts(  "  -I       Show firmware diagnostics since previous query");
+    puts(  "  -H       Show readings of past control cycles as CSV");
+    puts(  "  -W MSEC  Watch readings every MSEC ms until Ctrl-C\n");
 
     puts(  "Fan Control:");
     printf("  -f FAN   Select fan FAN to control (1-%d)\n", NUM_FAN);
     puts(  "  -d DUTY  Set selected fan to fixed duty (0-100)");
-    puts(  "  -m MODE  Set fan control mode ('manual' or 'linear')");
+    puts(  "  -m MODE  Set fan control mode ('manual', 'linear' or 'points')");
     printf("  -M TEMP  Set mapped sensor no. (1-%d)\n", NUM_TEMP);
-    puts(  "  -l PARA  Set linear control parameters (format see below)\n");
+    puts(  "  -l PARA  Set linear control parameters (format see below)");
+    puts(  "  -p PTS   Set multi-point control curve (format see below)\n");
 
     puts(  "Device Management:");
+    printf("  -P MSEC  Set control period (%d-%d)\n", PERIOD_MIN,
+           PERIOD_MAX);
     puts(  "  -L       Load configuration from EEPROM");
     puts(  "  -S       Save current configuration to EEPROM");
     puts(  "  -C       Generate fan curve as CSV samples");
     puts(  "  -R       Reset FanBoy (re-initializes USB as well)\n");
 
+#ifndef WIN32
+    puts(  "Recording:");
+    puts(  "  --record FILE  Record readings to FILE until Ctrl-C");
+    puts(  "  --dump FILE    Show recorded readings as CSV");
+    puts(  "  --from SEC     Dump from SEC (since epoch, < 0: before now)");
+    puts(  "  --to SEC       Dump until SEC (same format as --from)\n");
+#endif
+
     puts(  "Misc:");
     printf("  -D DEV   Set serial interface (default: '%s')\n", DEF_DEVICE);
+#ifndef WIN32
+    printf("  -U       Connect via fanboyd at '%s' (or -D SOCKET)\n", FB_SOCKET);
+#endif
     puts(  "  -V       Show FanBoy firmware version and build timestamp");
     puts(  "  -h       Show usage help text\n");
 
@@ -63,9 +153,56 @@ static inline void print_help()
 
     puts(  "Fan duty follows a linear curve between LOW_DUTY and HIGH_DUTY.\n");
 
+    printf("Multi-point curve format: 'DUTY:TEMP[,DUTY:TEMP...]' (max. %d)\n",
+           NUM_POINTS);
+    puts(  "  DUTY  Fan duty applied at TEMP");
+    puts(  "  TEMP  Temperature, increasing from point to point\n");
+
+    puts(  "Fan duty is interpolated between points, below the first and");
+    puts(  "above the last point their duty applies.\n");
+
     puts(  "This version of fanboycli was built " __DATE__ " " __TIME__ "\n");
 }
 
+static void on_interrupt(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+static inline bool fan_curve(fb_curve_t *curve)
+{
+    if (!fb_fan_curve_start())
+        return false;
+
+    // cancel generation on Ctrl-C instead of leaving it running
+    void (*prev)(int) = signal(SIGINT, on_interrupt);
+
+    fb_curve_state_t state = { .state = CURVE_RUNNING };
+    while (state.state == CURVE_RUNNING) {
+        if (interrupted) {
+            fb_fan_curve_cancel();
+            break;
+        }
+#ifndef WIN32
+        usleep(CURVE_POLL_MS * 1000);
+#else
+        Sleep(CURVE_POLL_MS);
+#endif
+        if (!fb_fan_curve_poll(&state))
+            break;
+        fprintf(stderr, "\rSampling duty step %d/%d", state.step, state.steps);
+    }
+    fputc('\n', stderr);
+
+    signal(SIGINT, prev);
+
+    if (state.state != CURVE_DONE)
+        return false;
+
+    return fb_fan_curve_result(curve);
+}
+
 static inline bool get_params(char *string, linear_t *params)
 {
     const char *ptr = strtok(string, PARAM_DELIMITER);
@@ -95,17 +232,60 @@ static inline bool get_params(char *string, linear_t *params)
     return true;
 }
 
+static inline bool get_points(const char *string, fb_points_t *points)
+{
+    memset(points, 0, sizeof(fb_points_t));
+
+    const char *ptr = string;
+    while (points->count < NUM_POINTS) {
+        char *end;
+        long duty = strtol(ptr, &end, 10);
+        if (end == ptr || *end != PARAM_DELIMITER[0] || duty < 0 || duty > 100)
+            return false;
+
+        ptr = end + 1;
+        double temp = strtod(ptr, &end);
+        if (end == ptr || temp < 0.0 || temp > 100.0)
+            return false;
+
+        point_t *point = &points->point[points->count];
+        point->duty = duty;
+        point->temp = temp * 100.0;
+        if (points->count && point->temp <= point[-1].temp)
+            return false;
+        points->count++;
+
+        if (*end == '\0')
+            return true;
+        if (*end != POINT_DELIMITER)
+            return false;
+        ptr = end + 1;
+    }
+
+    return false;
+}
+
+static inline const char *mode_name(uint8_t mode)
+{
+    switch (mode) {
+        case MODE_MANUAL: return "manual";
+        case MODE_LINEAR: return "linear";
+        case MODE_POINTS: return "points";
+        default:          return "unknown";
+    }
+}
+
 static inline void print_config(const fb_config_t *config)
 {
     puts("FanBoy config:");
 
     char unit = config->temp_unit == DEG_C ? 'C' : 'F';
     printf("  Temperature unit: %c\n", unit);
+    printf("  Control period:   %u ms\n", config->period);
 
     for (int i=0; i<NUM_FAN; i++) {
         printf("  Fan %d:\n", i+1);
-        printf("    Mode:         %s\n", config->fan[i].mode == MODE_MANUAL ?
-               "manual" : "linear");
+        printf("    Mode:         %s\n", mode_name(config->fan[i].mode));
         printf("    Manual duty:  %02d%%\n", config->fan[i].duty);
         printf("    Sensor:       %d\n", config->fan[i].sensor+1);
         puts("    Linear params:");
@@ -113,6 +293,12 @@ static inline void print_config(const fb_config_t *config)
                (double)config->fan[i].param.min_temp/100.0, unit);
         printf("      High:  %02d%% @ %.2f %c\n", config->fan[i].param.max_duty,
                (double)config->fan[i].param.max_temp/100.0, unit);
+        puts("    Curve points:");
+        const points_t *points = &config->fan[i].points;
+        for (int p=0; p<points->count && p<NUM_POINTS; p++)
+            printf("      %d:     %02d%% @ %.2f %c\n", p+1,
+                   points->point[p].duty,
+                   (double)points->point[p].temp/100.0, unit);
     }
 }
 
@@ -122,7 +308,9 @@ static inline void print_status(const fb_status_t *status)
 
     for (int i=0; i<NUM_FAN; i++) {
         printf("  Fan %d: ", i+1);
-        if (status->fan[i].rpm != NCONN)
+        if (status->fan[i].rpm == NSCAN)
+            puts("detecting");
+        else if (status->fan[i].rpm != NCONN)
             printf("%d%% @ %d rpm\n", status->fan[i].duty, status->fan[i].rpm);
         else
             puts("disconnected");
@@ -134,21 +322,244 @@ static inline void print_status(const fb_status_t *status)
         else
             puts("disconnected");
     }
+    if (status->flags & STATUS_SAVING)
+        puts("  Saving settings to EEPROM");
 }
 
+static inline void print_timing(const fb_timing_t *timing)
+{
+    puts("FanBoy control loop:");
+    printf("  Period:   %u ms\n", timing->period);
+    printf("  Cycles:   %u (%u skipped)\n", timing->cycles, timing->overruns);
+    printf("  Delay:    %u us avg, %u us max\n", timing->delay_avg,
+           timing->delay_max);
+    printf("  Jitter:   %d us .. %d us\n", timing->jitter_min,
+           timing->jitter_max);
+}
+
+static inline void print_csv_header(const char *first)
+{
+    printf("%s", first);
+    for (int i=0; i<NUM_FAN; i++)
+        printf(",duty%d,rpm%d", i+1, i+1);
+    for (int i=0; i<NUM_TEMP; i++)
+        printf(",temp%d", i+1);
+    putchar('\n');
+}
+
+static inline void print_csv_row(const fb_status_t *status)
+{
+    for (int i=0; i<NUM_FAN; i++) {
+        printf(",%u,", status->fan[i].duty);
+        if (status->fan[i].rpm < NSCAN)
+            printf("%u", status->fan[i].rpm);
+    }
+    for (int i=0; i<NUM_TEMP; i++) {
+        putchar(',');
+        if (status->temp[i] != NCONN)
+            printf("%.2f", (double)status->temp[i] / 100.0);
+    }
+    putchar('\n');
+}
+
+static inline void print_diag(const fb_diag_t *diag)
+{
+    static const char *phases[NUM_PHASE] = {
+        "Loop", "Measure", "Control", "Serial", "EEPROM"
+    };
+
+    uint32_t sec = diag->uptime / 1000;
+    puts("FanBoy diagnostics:");
+    printf("  Uptime:   %ud %02u:%02u:%02u\n", sec / 86400, sec / 3600 % 24,
+           sec / 60 % 60, sec % 60);
+    printf("  Stack:    %u of %u bytes never used\n", diag->stack_free,
+           diag->stack_size);
+    printf("  Serial:   %u bytes dropped, %u frames rejected\n",
+           diag->dropped, diag->errors);
+    for (int i=0; i<NUM_PHASE; i++) {
+        const phase_stats_t *phase = &diag->phase[i];
+        printf("  %-8s  %u runs, %u us avg, %u us max\n", phases[i],
+               phase->count, phase->avg, phase->max);
+    }
+}
+
+static inline bool print_history()
+{
+    // records take 2 bytes at least
+    static fb_sample_t samples[HIST_LEN / 2];
+    uint16_t seq = 0;
+    size_t count;
+
+    if (!fb_history(&seq, samples, HIST_LEN / 2, &count)) {
+        fprintf(stderr, "Failed to read history: %s\n", fb_error());
+        return false;
+    }
+
+    print_csv_header("cycle,age_ms");
+    for (size_t s=0; s<count; s++) {
+        printf("%u,%u", samples[s].seq, samples[s].age);
+        print_csv_row(&samples[s].status);
+    }
+
+    return true;
+}
+
+static inline bool batch_flush()
+{
+    if (batch.count == 0)
+        return true;
+
+    msg_result_t results[BATCH_LEN];
+    bool ret = fb_batch_run(&batch, results);
+    for (int i=0; !ret && i<batch.count; i++)
+        if (results[i].retult != RESULT_OK)
+            fprintf(stderr, "Failed to %s: %s\n", batch_what[i], fb_error());
+
+    fb_batch_init(&batch);
+
+    return ret;
+}
+
+static inline bool batch_reserve(size_t len, const char *what)
+{
+    bool ret = true;
+    if (batch.len + 1 + len > BATCH_LEN)
+        ret = batch_flush();
+
+    batch_what[batch.count] = what;
+
+    return ret;
+}
+
+static void on_status(const fb_status_t *status, void *ctx)
+{
+    (void)ctx;
+    print_status(status);
+    fflush(stdout);
+}
+
+static inline bool watch_status(uint16_t interval)
+{
+    if (!fb_subscribe(interval, on_status, NULL))
+        return false;
+
+    void (*prev)(int) = signal(SIGINT, on_interrupt);
+
+    bool ret = true;
+    while (!interrupted && ret)
+        ret = fb_poll(2 * interval);
+
+    signal(SIGINT, prev);
+
+    return ret;
+}
+
+#ifndef WIN32
+static void on_record(const fb_status_t *status, void *ctx)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    rec_append(ctx, now.tv_sec * 1000ull + now.tv_nsec / 1000000, status);
+}
+
+static inline bool record_status(const char *path)
+{
+    const char *error;
+    recording_t *rec = rec_open(path, true, &error);
+    if (rec == NULL) {
+        fprintf(stderr, "Failed to open recording '%s': %s\n", path, error);
+        return false;
+    }
+
+    bool ret = fb_subscribe(RECORD_INTERVAL, on_record, rec);
+    if (ret) {
+        void (*prev_int)(int) = signal(SIGINT, on_interrupt);
+        void (*prev_term)(int) = signal(SIGTERM, on_interrupt);
+
+        while (!interrupted && ret)
+            ret = fb_poll(2 * RECORD_INTERVAL);
+
+        signal(SIGINT, prev_int);
+        signal(SIGTERM, prev_term);
+    }
+    fb_subscribe(0, NULL, NULL);
+
+    if (!ret && !interrupted)
+        fprintf(stderr, "Failed to record status: %s\n", fb_error());
+    rec_close(rec);
+
+    return ret || interrupted;
+}
+
+static inline bool get_time(const char *string, uint64_t *time)
+{
+    char *end;
+    long long sec = strtoll(string, &end, 10);
+    if (end == string || *end != '\0')
+        return false;
+
+    // relative to now
+    if (sec < 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        sec += now.tv_sec;
+        if (sec < 0)
+            sec = 0;
+    }
+    *time = sec * 1000ull;
+
+    return true;
+}
+
+static void on_record_dump(const record_t *record, void *ctx)
+{
+    (void)ctx;
+    printf("%llu,%u", (unsigned long long)record->time / 1000,
+           record->count);
+    print_csv_row(&record->status);
+}
+
+static inline bool dump_recording(const char *path, uint64_t from,
+                                  uint64_t to)
+{
+    const char *error;
+    recording_t *rec = rec_open(path, false, &error);
+    if (rec == NULL) {
+        fprintf(stderr, "Failed to open recording '%s': %s\n", path, error);
+        return false;
+    }
+
+    print_csv_header("time,samples");
+    rec_query(rec, from, to, on_record_dump, NULL);
+    rec_close(rec);
+
+    return true;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
     const char *device = peek_device(argc, argv);
 
+#ifndef WIN32
+    if (!peek_offline(argc, argv) && !fb_init(device)) {
+#else
     if (!fb_init(device)) {
+#endif
         fprintf(stderr, "Failed to connect to '%s': %s\n", device, fb_error());
         return 1;
     }
 
     bool ret = true;
     uint8_t fan = 255;
-    char c;
-    while ((c = getopt(argc, argv, "D:sf:d:m:M:cl:CSLRhV")) != -1) {
+    fb_batch_init(&batch);
+#ifndef WIN32
+    uint64_t from = 0, to = UINT64_MAX;
+#endif
+    int c;
+    while ((c = getopt_long(argc, argv, "D:UsW:TIHf:d:m:M:cl:p:P:CSLRhV",
+                            LONG_OPTS, NULL)) != -1) {
         switch (c) {
             case 'h':
             {
@@ -157,6 +568,7 @@ int main(int argc, char *argv[])
             }
             case 'c':
             {
+                ret = batch_flush() && ret;
                 fb_config_t config;
                 if (fb_config(&config)) {
                     print_config(&config);
@@ -167,12 +579,14 @@ int main(int argc, char *argv[])
                 break;
             }
             case 'D':
+            case 'U':
             {
                 // already handled, skip
                 break;
             }
             case 's':
             {
+                ret = batch_flush() && ret;
                 fb_status_t status;
                 if (fb_status(&status)) {
                     print_status(&status);
@@ -182,6 +596,54 @@ int main(int argc, char *argv[])
                 }
                 break;
             }
+            case 'W':
+            {
+                int interval = atoi(optarg);
+                if (interval < SINT_MIN || interval > UINT16_MAX) {
+                    fprintf(stderr, "Error: invalid interval '%s'\n", optarg);
+                    ret = false;
+                    goto cleanup;
+                }
+                ret = batch_flush() && ret;
+                if (!watch_status(interval) && !interrupted) {
+                    fprintf(stderr, "Failed to watch status: %s\n",
+                            fb_error());
+                    ret = false;
+                }
+                fb_subscribe(0, NULL, NULL);
+                break;
+            }
+            case 'T':
+            {
+                ret = batch_flush() && ret;
+                fb_timing_t timing;
+                if (fb_timing(&timing)) {
+                    print_timing(&timing);
+                } else {
+                    fprintf(stderr, "Failed to read timing: %s\n", fb_error());
+                    ret = false;
+                }
+                break;
+            }
+            case 'I':
+            {
+                ret = batch_flush() && ret;
+                fb_diag_t diag;
+                if (fb_diag(&diag)) {
+                    print_diag(&diag);
+                } else {
+                    fprintf(stderr, "Failed to read diagnostics: %s\n",
+                            fb_error());
+                    ret = false;
+                }
+                break;
+            }
+            case 'H':
+            {
+                ret = batch_flush() && ret;
+                ret = print_history() && ret;
+                break;
+            }
             case 'f':
             {
                 fan = atoi(optarg) - 1;
@@ -205,10 +667,9 @@ int main(int argc, char *argv[])
                     ret = false;
                     goto cleanup;
                 }
-                if (!fb_set_duty(fan, duty)) {
-                    fprintf(stderr, "Failed to set fan duty: %s\n", fb_error());
-                    ret = false;
-                }
+                ret = batch_reserve(sizeof(msg_fan_duty_t), "set fan duty") &&
+                      ret;
+                fb_batch_set_duty(&batch, fan, duty);
                 break;
             }
             case 'm':
@@ -218,6 +679,8 @@ int main(int argc, char *argv[])
                     mode = MODE_MANUAL;
                 else if (strcmp("linear", optarg) == 0)
                     mode = MODE_LINEAR;
+                else if (strcmp("points", optarg) == 0)
+                    mode = MODE_POINTS;
                 else {
                     fprintf(stderr, "Error: invalid fan mode '%s'\n", optarg);
                     ret = false;
@@ -228,10 +691,9 @@ int main(int argc, char *argv[])
                     ret = false;
                     goto cleanup;
                 }
-                if (!fb_set_mode(fan, mode)) {
-                    fprintf(stderr, "Failed to set fan mode: %s\n", fb_error());
-                    ret = false;
-                }
+                ret = batch_reserve(sizeof(msg_fan_mode_t), "set fan mode") &&
+                      ret;
+                fb_batch_set_mode(&batch, fan, mode);
                 break;
             }
             case 'M':
@@ -247,10 +709,9 @@ int main(int argc, char *argv[])
                     ret = false;
                     goto cleanup;
                 }
-                if (!fb_set_map(fan, sensor)) {
-                    fprintf(stderr, "Failed to set mapping: %s\n", fb_error());
-                    ret = false;
-                }
+                ret = batch_reserve(sizeof(msg_fan_map_t), "set mapping") &&
+                      ret;
+                fb_batch_set_map(&batch, fan, sensor);
                 break;
             }
             case 'l':
@@ -266,19 +727,51 @@ int main(int argc, char *argv[])
                     ret = false;
                     goto cleanup;
                 }
-                if (!fb_set_linear(fan, &params)) {
-                    fprintf(stderr, "Failed to set linear parameters: %s\n",
-                            fb_error());
+                ret = batch_reserve(sizeof(msg_fan_linear_t),
+                                    "set linear parameters") && ret;
+                fb_batch_set_linear(&batch, fan, &params);
+                break;
+            }
+            case 'p':
+            {
+                fb_points_t points;
+                if (!get_points(optarg, &points)) {
+                    fprintf(stderr, "Error: invalid curve points '%s'\n",
+                            optarg);
+                    ret = false;
+                    goto cleanup;
+                }
+                if (fan >= NUM_FAN) {
+                    fprintf(stderr, "Error: invalid fan no. '%d'\n", fan);
                     ret = false;
+                    goto cleanup;
+                }
+                ret = batch_reserve(sizeof(msg_fan_points_t),
+                                    "set curve points") && ret;
+                fb_batch_set_points(&batch, fan, &points);
+                break;
+            }
+            case 'P':
+            {
+                int period = atoi(optarg);
+                if (period < PERIOD_MIN || period > PERIOD_MAX) {
+                    fprintf(stderr, "Error: invalid period '%s'\n", optarg);
+                    ret = false;
+                    goto cleanup;
                 }
+                ret = batch_reserve(sizeof(msg_period_t), "set period") &&
+                      ret;
+                fb_batch_set_period(&batch, period);
                 break;
             }
             case 'C':
             {
+                ret = batch_flush() && ret;
                 fb_curve_t curve;
                 printf("Generating fan curve (this may take some time)...\n");
-                if (!fb_fan_curve(&curve)) {
+                if (!fan_curve(&curve)) {
                     fprintf(stderr, "Failed to generate fan curve: %s\n",
+                            interrupted || !fb_error() ? "cancelled" :
                             fb_error());
                     ret = false;
                 } else {
@@ -294,30 +787,26 @@ int main(int argc, char *argv[])
             }
             case 'S':
             {
-                if (!fb_save()) {
-                    fprintf(stderr, "Failed to save configuration: %s\n",
-                            fb_error());
-                    ret = false;
-                }
+                ret = batch_reserve(0, "save configuration") && ret;
+                fb_batch_save(&batch);
                 break;
             }
             case 'L':
             {
-                if (!fb_load()) {
-                    fprintf(stderr, "Failed to load configuration: %s\n",
-                            fb_error());
-                    ret = false;
-                }
+                ret = batch_reserve(0, "load configuration") && ret;
+                fb_batch_load(&batch);
                 break;
             }
             case 'R':
             {
+                ret = batch_flush() && ret;
                 puts("Triggering FanBoy reset");
                 fb_reset();
                 goto cleanup;
             }
             case 'V':
             {
+                ret = batch_flush() && ret;
                 fb_version_t vers;
                 if (fb_version(&vers)) {
                     printf("FanBoy firmware:\n");
@@ -329,6 +818,29 @@ int main(int argc, char *argv[])
                 }
                 break;
             }
+#ifndef WIN32
+            case OPT_RECORD:
+            {
+                ret = batch_flush() && ret;
+                ret = record_status(optarg) && ret;
+                break;
+            }
+            case OPT_FROM:
+            case OPT_TO:
+            {
+                if (!get_time(optarg, c == OPT_FROM ? &from : &to)) {
+                    fprintf(stderr, "Error: invalid time '%s'\n", optarg);
+                    ret = false;
+                    goto cleanup;
+                }
+                break;
+            }
+            case OPT_DUMP:
+            {
+                ret = dump_recording(optarg, from, to) && ret;
+                break;
+            }
+#endif
             case '?':
             {
                 fprintf(stderr, "option -%c requires an argument\n", optopt);
@@ -346,6 +858,8 @@ int main(int argc, char *argv[])
     }
 
 cleanup:
+    // settings are sent batched, apply those still pending
+    ret = batch_flush() && ret;
 	fb_exit();
 	
     return !ret;
@@ -0,0 +1,302 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+#include "record.h"
+#include "firmware/history.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char REC_MAGIC[8] = "FANBOYRC";
+static const uint32_t REC_VERSION = 1;
+
+// default tiers: interval (ms), capacity (records)
+static const uint32_t DEF_INTERVAL[REC_TIERS] = { 1000, 60000, 3600000 };
+static const uint32_t DEF_CAPACITY[REC_TIERS] = { 6 * 3600, 28 * 1440,
+                                                  2 * 365 * 24 };
+
+/**
+ * @brief File header, followed by the records of all tiers
+ */
+typedef struct {
+    char      magic[8];         // `REC_MAGIC`
+    uint32_t  version;          // file format version
+    uint32_t  rec_len;          // record length in bytes
+    struct {
+        uint32_t  interval;     // interval per record (ms)
+        uint32_t  capacity;     // ring size (records)
+        uint64_t  written;      // no. of records written so far
+    } tier[REC_TIERS];
+} rec_header_t;
+
+/**
+ * @brief Interval being averaged
+ */
+typedef struct {
+    uint64_t  bucket;               // interval no. (time / interval)
+    uint32_t  count;                // no. of samples
+    uint32_t  sum[HIST_FIELDS];     // sum of valid values per field
+    uint32_t  valid[HIST_FIELDS];   // no. of valid values per field
+    bool      resumed;              // continues newest record of tier
+} rec_acc_t;
+
+struct recording {
+    int            fd;
+    size_t         size;            // file size
+    rec_header_t  *header;          // mapped file
+    record_t      *ring[REC_TIERS]; // records of each tier
+    rec_acc_t      acc[REC_TIERS];
+};
+
+
+static bool field_valid(uint8_t field, uint16_t value)
+{
+    // duties are always valid
+    return field < NUM_FAN || value < NSCAN;
+}
+
+static size_t file_size(const rec_header_t *header)
+{
+    size_t size = sizeof(rec_header_t);
+    for (int t=0; t<REC_TIERS; t++)
+        size += (size_t)header->tier[t].capacity * sizeof(record_t);
+
+    return size;
+}
+
+static bool header_valid(const rec_header_t *header, size_t size)
+{
+    if (memcmp(header->magic, REC_MAGIC, sizeof(REC_MAGIC)) != 0 ||
+            header->version != REC_VERSION ||
+            header->rec_len != sizeof(record_t))
+        return false;
+
+    for (int t=0; t<REC_TIERS; t++)
+        if (!header->tier[t].interval || !header->tier[t].capacity)
+            return false;
+
+    return file_size(header) <= size;
+}
+
+recording_t *rec_open(const char *path, bool append, const char **error)
+{
+    int fd = open(path, append ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *error = strerror(errno);
+        close(fd);
+        return NULL;
+    }
+
+    // set up new file
+    rec_header_t header;
+    size_t size = st.st_size;
+    if (size == 0 && append) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, REC_MAGIC, sizeof(REC_MAGIC));
+        header.version = REC_VERSION;
+        header.rec_len = sizeof(record_t);
+        for (int t=0; t<REC_TIERS; t++) {
+            header.tier[t].interval = DEF_INTERVAL[t];
+            header.tier[t].capacity = DEF_CAPACITY[t];
+        }
+        size = file_size(&header);
+        if (ftruncate(fd, size) < 0 ||
+                pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            *error = strerror(errno);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void *map = size < sizeof(rec_header_t) ? MAP_FAILED :
+                mmap(NULL, size, append ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED || !header_valid(map, size)) {
+        *error = "not a recording";
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        close(fd);
+        return NULL;
+    }
+
+    recording_t *rec = calloc(1, sizeof(recording_t));
+    if (rec == NULL) {
+        *error = "out of memory";
+        munmap(map, size);
+        close(fd);
+        return NULL;
+    }
+    rec->fd = fd;
+    rec->size = size;
+    rec->header = map;
+
+    record_t *ring = (record_t *)(rec->header + 1);
+    for (int t=0; t<REC_TIERS; t++) {
+        rec->ring[t] = ring;
+        ring += rec->header->tier[t].capacity;
+    }
+
+    return rec;
+}
+
+/**
+ * @brief Write record of averaged interval to tier
+ */
+static void flush(recording_t *rec, int tier)
+{
+    rec_acc_t *acc = &rec->acc[tier];
+    if (!acc->count)
+        return;
+
+    record_t record = {
+        .time = acc->bucket * rec->header->tier[tier].interval,
+        .count = acc->count
+    };
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        uint16_t value = NCONN;
+        if (acc->valid[i])
+            value = (acc->sum[i] + acc->valid[i] / 2) / acc->valid[i];
+        hist_set(&record.status, i, value);
+    }
+
+    // readers check `written` first, so the record has to be there before
+    uint64_t written = rec->header->tier[tier].written;
+    uint32_t capacity = rec->header->tier[tier].capacity;
+    if (acc->resumed) {
+        rec->ring[tier][(written - 1) % capacity] = record;
+    } else {
+        rec->ring[tier][written % capacity] = record;
+        __atomic_store_n(&rec->header->tier[tier].written, written + 1,
+                         __ATOMIC_RELEASE);
+    }
+
+    memset(acc, 0, sizeof(rec_acc_t));
+}
+
+/**
+ * @brief Continue averaging newest record of tier if it covers given interval
+ *
+ * Picks up the partial interval written by `rec_close()` of a previous
+ * recording session, each field's average counting as that many samples.
+ */
+static void resume(recording_t *rec, int tier, uint64_t bucket)
+{
+    rec_acc_t *acc = &rec->acc[tier];
+    uint64_t written = rec->header->tier[tier].written;
+    if (!written)
+        return;
+
+    const record_t *record = &rec->ring[tier][(written - 1) %
+                                              rec->header->tier[tier].capacity];
+    if (record->time != bucket * rec->header->tier[tier].interval)
+        return;
+
+    acc->count = record->count;
+    acc->resumed = true;
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        uint16_t value = hist_get(&record->status, i);
+        if (field_valid(i, value)) {
+            acc->sum[i] = (uint32_t)value * record->count;
+            acc->valid[i] = record->count;
+        }
+    }
+}
+
+void rec_append(recording_t *rec, uint64_t time, const fb_status_t *status)
+{
+    for (int t=0; t<REC_TIERS; t++) {
+        rec_acc_t *acc = &rec->acc[t];
+        uint64_t bucket = time / rec->header->tier[t].interval;
+        if (acc->count && bucket != acc->bucket)
+            flush(rec, t);
+        if (!acc->count)
+            resume(rec, t, bucket);
+
+        acc->bucket = bucket;
+        acc->count++;
+        for (uint8_t i=0; i<HIST_FIELDS; i++) {
+            uint16_t value = hist_get(status, i);
+            if (field_valid(i, value)) {
+                acc->sum[i] += value;
+                acc->valid[i]++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Find first record of tier not older than given time
+ *
+ * @return Record no., `written` if none
+ */
+static uint64_t lower_bound(const recording_t *rec, int tier, uint64_t oldest,
+                            uint64_t written, uint64_t time)
+{
+    uint32_t capacity = rec->header->tier[tier].capacity;
+    uint64_t lo = oldest, hi = written;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (rec->ring[tier][mid % capacity].time < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+int rec_query(const recording_t *rec, uint64_t from, uint64_t to,
+              rec_cb callback, void *ctx)
+{
+    uint64_t written = 0, oldest = 0;
+    int tier;
+    for (tier=0; tier<REC_TIERS; tier++) {
+        written = __atomic_load_n(&rec->header->tier[tier].written,
+                                  __ATOMIC_ACQUIRE);
+        uint32_t capacity = rec->header->tier[tier].capacity;
+        oldest = written > capacity ? written - capacity : 0;
+        if (tier == REC_TIERS-1 || written <= capacity ||
+                rec->ring[tier][oldest % capacity].time <= from)
+            break;
+    }
+
+    uint32_t capacity = rec->header->tier[tier].capacity;
+    for (uint64_t i = lower_bound(rec, tier, oldest, written, from);
+            i < written; i++) {
+        const record_t *record = &rec->ring[tier][i % capacity];
+        if (record->time >= to)
+            break;
+        callback(record, ctx);
+    }
+
+    return tier;
+}
+
+void rec_close(recording_t *rec)
+{
+    if (rec == NULL)
+        return;
+
+    for (int t=0; t<REC_TIERS; t++)
+        flush(rec, t);
+
+    msync(rec->header, rec->size, MS_SYNC);
+    munmap(rec->header, rec->size);
+    close(rec->fd);
+    free(rec);
+}
@@ -0,0 +1,100 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+/**
+ * @file
+ * @brief Binary time-series recordings of device status
+ *
+ * A recording is a single memory-mapped file made of a header and one ring
+ * of fixed-width records per tier. Tier 0 holds samples averaged per second,
+ * the following tiers the same samples averaged per minute and per hour. Each
+ * ring overwrites its oldest records once full, so finer tiers cover shorter
+ * periods of time.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libfanboy.h"
+
+#define REC_TIERS  3    // no. of tiers (1 s, 1 min, 1 h)
+
+/**
+ * @brief Record of a single interval
+ *
+ * Fields not valid throughout the interval (e.g. disconnected sensor) are
+ * averaged over the samples they were valid in, `NCONN` if never valid.
+ */
+typedef struct {
+    uint64_t     time;      //< start of interval (ms since epoch)
+    uint32_t     count;     //< no. of samples averaged
+    fb_status_t  status;    //< average readings (no flags)
+} record_t;
+
+/**
+ * @brief Recording handle, @see rec_open()
+ */
+typedef struct recording recording_t;
+
+/**
+ * @brief Callback receiving records, @see rec_query()
+ */
+typedef void (*rec_cb)(const record_t *record, void *ctx);
+
+
+/**
+ * @brief Open recording
+ *
+ * New recordings cover 6 hours in tier 0, 4 weeks in tier 1 and 2 years in
+ * tier 2, taking 2.5 MB.
+ *
+ * @param      path    File name
+ * @param      append  Open for appending, creating file if not existing
+ * @param[out] error   Error message in case of failure
+ *
+ * @return Recording handle, NULL on failure
+ */
+recording_t *rec_open(const char *path, bool append, const char **error);
+
+/**
+ * @brief Add sample to recording
+ *
+ * Records are written once a sample belongs to the next interval of a tier.
+ * An interval left partially written by `rec_close()` is continued rather
+ * than recorded twice.
+ *
+ * @param     rec     Recording handle
+ * @param     time    Time of sample (ms since epoch), not decreasing
+ * @param[in] status  Readings
+ */
+void rec_append(recording_t *rec, uint64_t time, const fb_status_t *status);
+
+/**
+ * @brief Get records within time range
+ *
+ * Uses the finest tier holding all records from `from` on, or the coarsest
+ * tier if none does. Records are located by binary search.
+ *
+ * @param rec       Recording handle
+ * @param from      Start of range (ms since epoch)
+ * @param to        End of range (ms since epoch, exclusive)
+ * @param callback  Callback invoked for each record, oldest first
+ * @param ctx       Context passed to `callback`
+ *
+ * @return Tier used
+ */
+int rec_query(const recording_t *rec, uint64_t from, uint64_t to,
+              rec_cb callback, void *ctx);
+
+/**
+ * @brief Close recording, writing records of intervals begun
+ */
+void rec_close(recording_t *rec);
+
+#endif
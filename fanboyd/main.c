@@ -0,0 +1,611 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libfanboy.h"
+#include "firmware/crc8.h"
+
+#define MAX_CLIENTS  32     // max. no. of concurrent clients
+
+const char *DEF_DEVICE = "/dev/ttyACM0";
+const int RECONNECT_MS = 1000;
+
+/**
+ * @brief Connected client
+ */
+typedef struct {
+    int       fd;                   // client socket (-1: unused)
+    uint8_t   buf[sizeof(header_t) + SERIAL_BUFS + 1];  // pending request
+    size_t    len;                  // no. of bytes in `buf`
+    uint16_t  sub_int;              // status interval (ms, 0: off)
+    uint64_t  sub_next;             // next status due (ms)
+} client_t;
+
+static const char   *device = NULL;
+static const char   *sock_path = FB_SOCKET;
+static uint16_t      interval = UPDATE_INT;     // status refresh interval (ms)
+static int           listen_fd = -1;
+
+static fb_device_t  *dev = NULL;
+static uint64_t      dev_next = 0;      // next status refresh or reconnect
+static bool          dev_lost = false;  // connection failure already logged
+static fb_version_t  version;
+static fb_status_t   status;
+static uint64_t      status_time = 0;   // time `status` was read (ms)
+static fb_config_t   config;
+static bool          status_valid = false;
+static bool          config_valid = false;
+
+static client_t      clients[MAX_CLIENTS];
+
+
+static inline void print_help()
+{
+    puts("Usage: fanboyd [ARGUMENT(S)]\n");
+
+    puts(  "Keeps the connection to a FanBoy and serves local clients.\n");
+
+    printf("  -D DEV   Set serial interface (default: '%s')\n", DEF_DEVICE);
+    printf("  -s PATH  Set socket path (default: '%s')\n", FB_SOCKET);
+    printf("  -i MSEC  Status refresh interval (default: %d)\n", UPDATE_INT);
+    puts(  "  -h       Show usage help text\n");
+}
+
+static uint64_t now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void client_drop(client_t *client)
+{
+    close(client->fd);
+    client->fd = -1;
+}
+
+static void reply(client_t *client, uint8_t seq, uint8_t command,
+                  const void *payload, uint8_t len)
+{
+    uint8_t frame[sizeof(header_t) + UINT8_MAX + 1];
+    header_t header = { .sof = SOF, .seq = seq, .cmd = command, .len = len };
+
+    memcpy(frame, &header, sizeof(header));
+    if (len)
+        memcpy(frame + sizeof(header), payload, len);
+    frame[sizeof(header) + len] = crc8(frame, sizeof(header) + len);
+
+    // replies are small, a client not even taking those is stuck
+    size_t frame_len = sizeof(header) + len + 1;
+    if (send(client->fd, frame, frame_len, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+            (ssize_t)frame_len)
+        client_drop(client);
+}
+
+static void dev_connect()
+{
+    const char *error = NULL;
+    dev = fb_open(device, &error);
+    if (dev == NULL) {
+        if (!dev_lost)
+            fprintf(stderr, "Failed to connect to '%s': %s\n", device, error);
+        dev_lost = true;
+        return;
+    }
+
+    if (!fb_dev_version(dev, &version)) {
+        if (!dev_lost)
+            fprintf(stderr, "Failed to read version: %s\n", fb_dev_error(dev));
+        dev_lost = true;
+        fb_close(dev);
+        dev = NULL;
+        return;
+    }
+
+    fprintf(stderr, "Connected to '%s' (firmware %s)\n", device,
+            version.version);
+    dev_lost = false;
+    status_valid = false;
+    config_valid = false;
+}
+
+static void dev_fail()
+{
+    fprintf(stderr, "Lost connection to '%s': %s\n", device,
+            fb_dev_error(dev));
+    fb_close(dev);
+    dev = NULL;
+    dev_lost = true;
+    status_valid = false;
+    config_valid = false;
+}
+
+static bool refresh_status()
+{
+    if (dev == NULL)
+        return false;
+
+    status_valid = fb_dev_status(dev, &status);
+    if (!status_valid)
+        dev_fail();
+    else
+        status_time = now_ms();
+
+    return status_valid;
+}
+
+static bool refresh_config()
+{
+    if (dev == NULL)
+        return false;
+
+    config_valid = fb_dev_config(dev, &config);
+    if (!config_valid)
+        dev_fail();
+
+    return config_valid;
+}
+
+/**
+ * @brief Drop device if the latest forwarded request got no reply
+ *
+ * @return true if the device was dropped
+ */
+static bool link_check()
+{
+    if (dev == NULL || !fb_dev_link_failed(dev))
+        return false;
+
+    dev_fail();
+
+    return true;
+}
+
+/**
+ * @brief Answer failed forwarded request that has no result code
+ *
+ * Rejects the request as the device did, unless the device is disconnected or
+ * did not reply.
+ */
+static void reject(client_t *client, uint8_t seq)
+{
+    if (dev == NULL || link_check())
+        return;
+
+    reply(client, seq, CMD_INVALID, NULL, 0);
+}
+
+/**
+ * @brief Answer request from cache or by forwarding it to the device
+ *
+ * Requests that cannot be served (device disconnected or not replying) remain
+ * unanswered, i.e. the client runs into a timeout as with an unresponsive
+ * device. Requests the device rejected are answered with `RESULT_ERR` or
+ * `CMD_INVALID`.
+ */
+static void handle_request(client_t *client, uint8_t seq, uint8_t command,
+                           uint8_t *data)
+{
+    uint8_t result = RESULT_ERR;
+
+    // reading cached values does not involve the device
+    switch ((cmd_t)command) {
+        case CMD_VERSION:
+            if (dev)
+                reply(client, seq, command, &version, sizeof(version));
+            return;
+        case CMD_STATUS:
+            if (status_valid || refresh_status())
+                reply(client, seq, command, &status, sizeof(status));
+            return;
+        case CMD_CONFIG:
+            if (config_valid || refresh_config())
+                reply(client, seq, command, &config, sizeof(config));
+            return;
+        case CMD_SUBSCRIBE:
+        {
+            // served from cache, independent of other clients
+            msg_subscribe_t *msg = (msg_subscribe_t *)data;
+            if (msg->interval == 0 || msg->interval >= SINT_MIN) {
+                client->sub_int = msg->interval;
+                client->sub_next = now_ms() + msg->interval;
+                result = RESULT_OK;
+            }
+            reply(client, seq, command, &result, sizeof(result));
+            return;
+        }
+        case CMD_TIMING:
+        {
+            // not cached, but reading does not change device state either
+            fb_timing_t timing;
+            if (dev && fb_dev_timing(dev, &timing))
+                reply(client, seq, command, &timing, sizeof(timing));
+            else
+                reject(client, seq);
+            return;
+        }
+        case CMD_DIAG:
+        {
+            fb_diag_t diag;
+            if (dev && fb_dev_diag(dev, &diag))
+                reply(client, seq, command, &diag, sizeof(diag));
+            else
+                reject(client, seq);
+            return;
+        }
+        case CMD_HISTORY:
+        {
+            msg_history_req_t *msg = (msg_history_req_t *)data;
+            uint8_t chunk[UINT8_MAX];
+            size_t len;
+            if (dev && fb_dev_history_chunk(dev, msg->seq, chunk, &len))
+                reply(client, seq, command, chunk, len);
+            else
+                reject(client, seq);
+            return;
+        }
+        default:
+            break;
+    }
+
+    if (dev == NULL)
+        return;
+
+    // everything else may change device state
+    status_valid = false;
+    config_valid = false;
+
+    switch ((cmd_t)command) {
+        case CMD_FAN_MODE:
+        {
+            msg_fan_mode_t *msg = (msg_fan_mode_t *)data;
+            if (fb_dev_set_mode(dev, msg->fan, msg->mode))
+                result = RESULT_OK;
+            break;
+        }
+        case CMD_FAN_DUTY:
+        {
+            msg_fan_duty_t *msg = (msg_fan_duty_t *)data;
+            if (fb_dev_set_duty(dev, msg->fan, msg->duty))
+                result = RESULT_OK;
+            break;
+        }
+        case CMD_FAN_MAP:
+        {
+            msg_fan_map_t *msg = (msg_fan_map_t *)data;
+            if (fb_dev_set_map(dev, msg->fan, msg->sensor))
+                result = RESULT_OK;
+            break;
+        }
+        case CMD_LINEAR:
+        {
+            msg_fan_linear_t *msg = (msg_fan_linear_t *)data;
+            if (fb_dev_set_linear(dev, msg->fan, &msg->param))
+                result = RESULT_OK;
+            break;
+        }
+        case CMD_POINTS:
+        {
+            msg_fan_points_t *msg = (msg_fan_points_t *)data;
+            if (fb_dev_set_points(dev, msg->fan, &msg->points))
+                result = RESULT_OK;
+            break;
+        }
+        case CMD_PERIOD:
+        {
+            msg_period_t *msg = (msg_period_t *)data;
+            if (fb_dev_set_period(dev, msg->period))
+                result = RESULT_OK;
+            break;
+        }
+        case CMD_BATCH:
+        {
+            fb_batch_t batch;
+            msg_batch_t *msg = (msg_batch_t *)data;
+            batch.count = msg->count;
+            batch.len = msg->len;
+            memcpy(batch.data, data + sizeof(msg_batch_t), msg->len);
+
+            msg_result_t results[BATCH_LEN];
+            if (!fb_dev_batch_run(dev, &batch, results) && link_check())
+                return;
+            reply(client, seq, command, results,
+                  batch.count * sizeof(*results));
+            return;
+        }
+        case CMD_FAN_CURVE:
+            if (fb_dev_fan_curve_start(dev))
+                result = RESULT_OK;
+            break;
+        case CMD_CURVE_STATE:
+        {
+            fb_curve_state_t state;
+            if (fb_dev_fan_curve_poll(dev, &state))
+                reply(client, seq, command, &state, sizeof(state));
+            else
+                reject(client, seq);
+            return;
+        }
+        case CMD_CURVE_DATA:
+        {
+            fb_curve_t curve;
+            if (fb_dev_fan_curve_result(dev, &curve))
+                reply(client, seq, command, &curve, sizeof(curve));
+            else
+                reject(client, seq);
+            return;
+        }
+        case CMD_CURVE_STOP:
+            if (fb_dev_fan_curve_cancel(dev))
+                result = RESULT_OK;
+            break;
+        case CMD_SAVE:
+            if (fb_dev_save(dev))
+                result = RESULT_OK;
+            break;
+        case CMD_LOAD:
+            if (fb_dev_load(dev))
+                result = RESULT_OK;
+            break;
+        case CMD_RESET:
+            // device re-enumerates, reconnect once it is back
+            fprintf(stderr, "Resetting '%s'\n", device);
+            fb_dev_reset(dev);
+            fb_close(dev);
+            dev = NULL;
+            dev_next = now_ms() + RECONNECT_MS;
+            return;
+        default:
+            return;
+    }
+
+    if (result != RESULT_OK && link_check())
+        return;
+    reply(client, seq, command, &result, sizeof(result));
+}
+
+/**
+ * @brief Handle all complete request frames received from client
+ */
+static void client_process(client_t *client)
+{
+    while (client->fd >= 0) {
+        // drop garbage preceding start of frame
+        uint8_t *sof = memchr(client->buf, SOF, client->len);
+        size_t skip = sof ? (size_t)(sof - client->buf) : client->len;
+        memmove(client->buf, client->buf + skip, client->len - skip);
+        client->len -= skip;
+
+        header_t *header = (header_t *)client->buf;
+        if (client->len < sizeof(header_t))
+            return;
+        size_t frame_len = sizeof(header_t) + header->len + 1;
+        if (frame_len > sizeof(client->buf)) {
+            // no request is that long
+            reply(client, header->seq, CMD_INVALID, NULL, 0);
+            client->len = 0;
+            return;
+        }
+        if (client->len < frame_len)
+            return;
+
+        // skip start of frame only if checksum fails
+        size_t used = frame_len;
+        uint8_t *payload = client->buf + sizeof(header_t);
+        int len = request_len(header->cmd);
+        if (header->cmd == CMD_BATCH && header->len >= len) {
+            msg_batch_t *batch = (msg_batch_t *)payload;
+            len = batch->count > BATCH_LEN ? -1 : len + batch->len;
+        }
+
+        if (client->buf[frame_len-1] != crc8(client->buf, frame_len-1)) {
+            reply(client, header->seq, CMD_CHECKSUM, NULL, 0);
+            used = 1;
+        } else if (len < 0 || header->len != len) {
+            reply(client, header->seq, CMD_INVALID, NULL, 0);
+        } else {
+            handle_request(client, header->seq, header->cmd, payload);
+        }
+
+        if (client->fd < 0)
+            return;
+        memmove(client->buf, client->buf + used, client->len - used);
+        client->len -= used;
+    }
+}
+
+static void client_read(client_t *client)
+{
+    ssize_t ret = read(client->fd, client->buf + client->len,
+                       sizeof(client->buf) - client->len);
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (ret <= 0) {
+        client_drop(client);
+        return;
+    }
+
+    client->len += ret;
+    client_process(client);
+
+    // buffer full without a complete frame, start over
+    if (client->fd >= 0 && client->len == sizeof(client->buf))
+        client->len = 0;
+}
+
+static void client_accept()
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    for (int i=0; i<MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            memset(&clients[i], 0, sizeof(client_t));
+            clients[i].fd = fd;
+            return;
+        }
+    }
+
+    fprintf(stderr, "Too many clients, rejecting connection\n");
+    close(fd);
+}
+
+/**
+ * @brief Refresh cache, reconnect and push status to subscribers as due
+ *
+ * @return Time until next action is due (ms)
+ */
+static int run_timers()
+{
+    uint64_t now = now_ms();
+    if (now >= dev_next) {
+        dev_next = now + (dev ? interval : RECONNECT_MS);
+        if (dev == NULL)
+            dev_connect();
+        if (dev)
+            refresh_status();
+    }
+
+    uint64_t next = dev_next;
+    for (int i=0; i<MAX_CLIENTS; i++) {
+        client_t *client = &clients[i];
+        if (client->fd < 0 || client->sub_int == 0)
+            continue;
+        if (now >= client->sub_next) {
+            // subscribers may ask for more than the cache refresh interval
+            client->sub_next = now + client->sub_int;
+            if ((status_valid && now - status_time < client->sub_int) ||
+                    refresh_status())
+                reply(client, 0, CMD_STATUS_EVENT, &status, sizeof(status));
+        }
+        if (client->fd >= 0 && client->sub_next < next)
+            next = client->sub_next;
+    }
+
+    return next > now ? next - now : 0;
+}
+
+static bool listen_open()
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long\n");
+        return false;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("Failed to create socket");
+        return false;
+    }
+
+    // remove stale socket of previous instance
+    unlink(sock_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, MAX_CLIENTS) != 0) {
+        fprintf(stderr, "Failed to listen on '%s': %s\n", sock_path,
+                strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void terminate(int sig)
+{
+    (void)sig;
+    unlink(sock_path);
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    device = DEF_DEVICE;
+
+    int c;
+    while ((c = getopt(argc, argv, "D:s:i:h")) != -1) {
+        switch (c) {
+            case 'D':
+                device = optarg;
+                break;
+            case 's':
+                sock_path = optarg;
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                if (interval < SINT_MIN) {
+                    fprintf(stderr, "Error: invalid interval '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                fprintf(stderr, "invalid argument(s). Try -h for help.\n");
+                return 1;
+        }
+    }
+
+    for (int i=0; i<MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!listen_open())
+        return 1;
+
+    struct pollfd pfd[MAX_CLIENTS + 1];
+    while (true) {
+        int timeout = run_timers();
+
+        pfd[0].fd = listen_fd;
+        pfd[0].events = POLLIN;
+        for (int i=0; i<MAX_CLIENTS; i++) {
+            pfd[i+1].fd = clients[i].fd;
+            pfd[i+1].events = POLLIN;
+        }
+
+        if (poll(pfd, MAX_CLIENTS + 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (int i=0; i<MAX_CLIENTS; i++)
+            if (clients[i].fd >= 0 &&
+                    pfd[i+1].revents & (POLLIN | POLLERR | POLLHUP))
+                client_read(&clients[i]);
+        if (pfd[0].revents & POLLIN)
+            client_accept();
+    }
+
+    terminate(0);
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+/*
+ * Checks the fixed-point linear fan control of firmware/control.h against the
+ * floating-point equation it replaced, for every temperature under boundary
+ * and random parameter sets. Exits non-zero on the first mismatch.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "firmware/control.h"
+
+static const int NUM_RANDOM = 1000;   // random parameter sets
+
+static const uint16_t TEMPS[] = {
+    0, 1, 2, 99, 100, 2000, 4000, 32767, 32768, 65533, 65534, 65535
+};
+static const uint8_t DUTIES[] = { 0, 1, 33, 80, 99, 100, 254, 255 };
+
+#define LEN(A)  (sizeof(A) / sizeof(A[0]))
+
+static uint32_t rng = 0x2545f491;
+
+
+/**
+ * @brief Duty as computed by the firmware before switching to fixed-point
+ */
+static uint8_t linear_double(const linear_t *param, uint16_t temp)
+{
+    double t = temp;
+    double t_min = param->min_temp;
+    double t_max = param->max_temp;
+
+    if (t <= t_min)
+        return param->min_duty;
+    if (t >= t_max)
+        return param->max_duty;
+
+    return param->min_duty + (t - t_min) *
+        (param->max_duty - param->min_duty) / (t_max - t_min);
+}
+
+static uint32_t xorshift()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+
+    return rng;
+}
+
+static bool check(const linear_t *param)
+{
+    linear_fp_t fp;
+    linear_prepare(param, &fp);
+
+    for (uint32_t t=0; t<=UINT16_MAX; t++) {
+        uint8_t expected = linear_double(param, t);
+        uint8_t duty = linear_duty(param, &fp, t);
+        if (duty != expected) {
+            fprintf(stderr, "mismatch for %u:%u:%u:%u at %u: %u, expected "
+                    "%u\n", param->min_duty, param->min_temp,
+                    param->max_duty, param->max_temp, t, duty, expected);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main()
+{
+    unsigned sets = 0;
+
+    for (size_t tl=0; tl<LEN(TEMPS); tl++)
+        for (size_t tu=0; tu<LEN(TEMPS); tu++)
+            for (size_t dl=0; dl<LEN(DUTIES); dl++)
+                for (size_t du=0; du<LEN(DUTIES); du++) {
+                    linear_t param = {
+                        .min_temp = TEMPS[tl], .min_duty = DUTIES[dl],
+                        .max_temp = TEMPS[tu], .max_duty = DUTIES[du]
+                    };
+                    if (!check(&param))
+                        return 1;
+                    sets++;
+                }
+
+    for (int i=0; i<NUM_RANDOM; i++) {
+        uint32_t r = xorshift();
+        linear_t param = {
+            .min_temp = r & 0xffff, .max_temp = r >> 16,
+            .min_duty = xorshift() % 101, .max_duty = xorshift() % 101
+        };
+        if (!check(&param))
+            return 1;
+        sets++;
+    }
+
+    printf("%u parameter sets checked, no mismatch\n", sets);
+
+    return 0;
+}
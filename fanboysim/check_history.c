@@ -0,0 +1,261 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+/*
+ * Checks the history codec and ring buffer of firmware/history.h: records
+ * decode to the readings recorded, which stay within the deadband of those
+ * measured, steady readings take the mask only, dropping the oldest records
+ * keeps the ring decodable and chunks cover every cycle held. Exits non-zero
+ * on the first failure.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "firmware/history.h"
+
+#define NUM_CYCLES  20000   // cycles pushed into the ring
+#define PHASE_LEN   500     // cycles per phase of readings
+
+/**
+ * @brief Behavior of readings, changing every `PHASE_LEN` cycles
+ */
+enum {
+    STEADY,     // noise within deadband
+    RAMP,       // rising steadily
+    NOISY,      // noise beyond deadband
+    JUMPS,      // random values, including 0, `NSCAN` and `NCONN`
+    NUM_PHASES
+};
+
+static uint32_t rng = 0x2545f491;
+
+static hist_t     hist;
+static status_t   recorded[NUM_CYCLES];     // readings recorded, by cycle no.
+static uint16_t   center[HIST_FIELDS];      // value readings vary around
+
+
+static uint32_t xorshift()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+
+    return rng;
+}
+
+static int noise(int amplitude)
+{
+    return (int)(xorshift() % (2 * amplitude + 1)) - amplitude;
+}
+
+/**
+ * @brief Get readings of given cycle
+ */
+static void measure(status_t *values, int cycle)
+{
+    int phase = (cycle / PHASE_LEN) % NUM_PHASES;
+
+    // vary around the readings recorded, unless those are special
+    if (phase == STEADY && cycle % PHASE_LEN == 0) {
+        for (uint8_t i=NUM_FAN; i<HIST_FIELDS; i++) {
+            uint16_t value = hist_get(&hist.last, i);
+            if (value && value < NSCAN)
+                center[i] = value;
+        }
+    }
+
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        bool rpm = i >= NUM_FAN && i < 2 * NUM_FAN;
+        int value = center[i];
+        if (i < NUM_FAN) {
+            if (phase != STEADY && xorshift() % 50 == 0)
+                center[i] = xorshift() % 101;
+            value = center[i];
+        } else if (phase == STEADY) {
+            value += noise(hist_deadband(i) / 2);
+        } else if (phase == RAMP) {
+            center[i] += 25;
+            value += noise(hist_deadband(i) / 2);
+        } else if (phase == NOISY) {
+            value += noise(5 * hist_deadband(i));
+        } else if (xorshift() % 20 == 0) {
+            value = xorshift() % 3 ? 0 : rpm ? NSCAN : NCONN;
+        } else {
+            value = center[i] = 500 + xorshift() % 5000;
+        }
+        hist_set(values, i, value < 0 ? 0 : value);
+    }
+}
+
+static bool same(const status_t *a, const status_t *b)
+{
+    for (uint8_t i=0; i<HIST_FIELDS; i++)
+        if (hist_get(a, i) != hist_get(b, i))
+            return false;
+
+    return true;
+}
+
+/**
+ * @brief Get readings recorded before given cycle
+ */
+static status_t before(uint16_t seq)
+{
+    status_t values;
+    if (seq)
+        return recorded[seq - 1];
+
+    memset(&values, 0, sizeof(values));
+    return values;
+}
+
+/**
+ * @brief Encode and decode a single record
+ *
+ * @return Record length, 0 on failure
+ */
+static uint8_t check_codec(const status_t *prev, const status_t *values)
+{
+    status_t rec_values = *prev;
+    uint8_t rec[HIST_REC_MAX];
+    uint8_t len = hist_encode(&rec_values, values, rec);
+
+    status_t decoded = *prev;
+    if (hist_reclen(rec, sizeof(rec), 0) != len ||
+            hist_decode(rec, sizeof(rec), 0, &decoded) != len ||
+            !same(&decoded, &rec_values)) {
+        fprintf(stderr, "record does not decode to readings recorded\n");
+        return 0;
+    }
+
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        uint16_t value = hist_get(values, i);
+        uint16_t rec_value = hist_get(&rec_values, i);
+        uint16_t diff = value > rec_value ? value - rec_value :
+                        rec_value - value;
+        bool exact = !value || value >= NSCAN;
+        if (diff > (exact ? 0 : hist_deadband(i))) {
+            fprintf(stderr, "field %u recorded as %u, measured %u\n", i,
+                    rec_value, value);
+            return 0;
+        }
+    }
+
+    return len;
+}
+
+static bool check_ring(int cycles)
+{
+    if (hist.len > HIST_LEN || hist.seq + hist.count != cycles) {
+        fprintf(stderr, "ring holds cycles %u-%u of %d\n", hist.seq,
+                hist.seq + hist.count, cycles);
+        return false;
+    }
+
+    // decoding from the base yields all cycles held
+    status_t values = hist.base;
+    status_t expected = before(hist.seq);
+    if (!same(&values, &expected)) {
+        fprintf(stderr, "base of cycle %u wrong\n", hist.seq);
+        return false;
+    }
+    uint16_t pos = hist.head, len = 0;
+    for (uint16_t i=0; i<hist.count; i++) {
+        uint8_t n = hist_decode(hist.data, HIST_LEN, pos, &values);
+        if (!same(&values, &recorded[hist.seq + i])) {
+            fprintf(stderr, "cycle %u decodes wrong\n", hist.seq + i);
+            return false;
+        }
+        pos = (pos + n) % HIST_LEN;
+        len += n;
+    }
+    if (len != hist.len) {
+        fprintf(stderr, "ring length %u, records %u\n", hist.len, len);
+        return false;
+    }
+
+    return true;
+}
+
+static bool check_chunks()
+{
+    // fetch all cycles held chunk by chunk, as fb_history() does, starting
+    // with one no longer held
+    uint16_t seq = hist.seq - 1;
+    uint16_t expected = hist.seq;
+    uint16_t end = hist.seq + hist.count;
+    while (expected != end) {
+        msg_history_t msg;
+        uint16_t pos;
+        uint16_t len = hist_chunk(&hist, seq, &msg, &pos);
+        status_t values = msg.base;
+        status_t base = before(msg.seq);
+        if (msg.seq != expected || msg.end != end || !msg.count ||
+                len > HIST_CHUNK || !same(&values, &base)) {
+            fprintf(stderr, "chunk for %u: %u records from %u\n", seq,
+                    msg.count, msg.seq);
+            return false;
+        }
+
+        uint16_t used = 0;
+        for (uint8_t i=0; i<msg.count; i++) {
+            used += hist_decode(hist.data, HIST_LEN, pos + used, &values);
+            if (!same(&values, &recorded[msg.seq + i])) {
+                fprintf(stderr, "cycle %u decodes wrong in chunk\n",
+                        msg.seq + i);
+                return false;
+            }
+        }
+        if (used != len) {
+            fprintf(stderr, "chunk length %u, records %u\n", len, used);
+            return false;
+        }
+
+        seq = expected = msg.seq + msg.count;
+    }
+
+    return true;
+}
+
+int main()
+{
+    status_t values;
+    memset(&values, 0, sizeof(values));
+    memset(&hist, 0, sizeof(hist));
+    for (uint8_t i=0; i<HIST_FIELDS; i++)
+        center[i] = i < NUM_FAN ? 50 : 1000 + 100 * i;
+
+    uint32_t steady_bytes = 0, steady_cycles = 0;
+    for (int c=0; c<NUM_CYCLES; c++) {
+        measure(&values, c);
+        uint8_t len = check_codec(&hist.last, &values);
+        if (!len)
+            return 1;
+
+        // first cycle of a steady phase may record the step to it
+        if ((c / PHASE_LEN) % NUM_PHASES == STEADY && c % PHASE_LEN) {
+            if (len != 2) {
+                fprintf(stderr, "steady cycle %d takes %u bytes\n", c, len);
+                return 1;
+            }
+            steady_bytes += len;
+            steady_cycles++;
+        }
+
+        hist_push(&hist, &values);
+        recorded[c] = hist.last;
+        if (!check_ring(c + 1) || !check_chunks())
+            return 1;
+    }
+
+    printf("%d cycles checked, %u held, steady cycles take %u bytes\n",
+           NUM_CYCLES, hist.count, steady_bytes / steady_cycles);
+
+    return 0;
+}
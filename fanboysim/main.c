@@ -0,0 +1,738 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of
+ * the MIT License, see file 'LICENSE'.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "firmware/serial.h"
+#include "firmware/control.h"
+#include "firmware/crc8.h"
+#include "firmware/history.h"
+
+const char *PARAM_DELIMITER = ":";
+
+// EEPROM write time of a settings record (~3.3 ms per byte)
+static const uint32_t EEPROM_WRITE_MS = (sizeof(config_t) + 4) * 33 / 10;
+
+static int          pty = -1;           // PTY master
+static const char  *link_path = NULL;   // symlink to PTY slave (optional)
+
+static uint8_t      num_conn = NUM_FAN; // no. of connected fans
+static uint16_t     max_rpm = 1500;     // fan speed at 100% duty
+static uint16_t     temps[NUM_TEMP];    // sensor readings (*100 deg)
+static useconds_t   latency = 0;        // reply latency (us)
+static uint32_t     curve_ms = CURVE_SDELAY + CURVE_SMPNUM * CURVE_SMPDEL;
+
+static config_t     opts;
+static config_t     eeprom;
+static bool         eeprom_valid = false;
+static uint64_t     eeprom_done;        // end of emulated EEPROM write (ms)
+static bool         scanning;           // emulated fan detection running
+static uint64_t     scan_done;          // end of fan detection (ms)
+static status_t     status;
+static linear_fp_t  linear[NUM_FAN];
+static duty_table_t table[NUM_FAN];
+static version_t    version;
+static uint8_t      buffer[UINT8_MAX];
+
+static uint8_t          curve_state = CURVE_IDLE;
+static uint8_t          curve_step = 0;
+static struct timespec  curve_begin;
+static msg_fan_curve_t  curve_data;
+
+static uint16_t         stream_int = DEF_SINT;  // status interval (ms)
+static uint64_t         stream_next;
+
+static uint64_t         timing_begin;   // start of timing statistics (ms)
+static uint64_t         boot;           // start of emulation (ms)
+static msg_diag_t       diag;           // diagnostics since previous query
+
+static hist_t           hist;
+static uint64_t         hist_next;      // next control cycle to record (ms)
+
+
+static inline void print_help()
+{
+    puts("Usage: fanboysim [ARGUMENT(S)]\n");
+
+    puts(  "Emulates a FanBoy on a pseudo-terminal, printing its path.\n");
+
+    printf("  -n NUM   No. of connected fans (0-%d, default: %d)\n", NUM_FAN,
+           NUM_FAN);
+    puts(  "  -r RPM   Fan speed at 100% duty (default: 1500)");
+    puts(  "  -t TEMP  Sensor readings, colon-separated (default: 25.00)");
+    puts(  "  -l USEC  Reply latency in microseconds (default: 0)");
+    printf("  -c MSEC  Fan curve step duration (default: %u)\n", curve_ms);
+    puts(  "  -p PATH  Create symlink PATH pointing to the pseudo-terminal");
+    puts(  "  -h       Show usage help text\n");
+}
+
+static inline bool get_temps(char *string)
+{
+    const char *ptr = strtok(string, PARAM_DELIMITER);
+    for (int i=0; i<NUM_TEMP; i++) {
+        if (ptr == NULL)
+            return i > 0;
+        double temp = atof(ptr);
+        if (temp < 0.0 || temp > 600.0)
+            return false;
+        temps[i] = temp * 100.0;
+        ptr = strtok(NULL, PARAM_DELIMITER);
+    }
+
+    return ptr == NULL;
+}
+
+static void defaults()
+{
+    opts.temp_unit = DEF_UNIT;
+    opts.period = UPDATE_INT;
+    for (int i=0; i<NUM_FAN; i++) {
+        opts.fan[i].mode = DEF_MODE;
+        opts.fan[i].duty = DEF_DUTY;
+        opts.fan[i].sensor = DEF_MAP;
+        opts.fan[i].param.min_temp = DEF_LIN_TL;
+        opts.fan[i].param.min_duty = DEF_LIN_DL;
+        opts.fan[i].param.max_temp = DEF_LIN_TU;
+        opts.fan[i].param.max_duty = DEF_LIN_DU;
+        opts.fan[i].points.count = 2;
+        opts.fan[i].points.point[0].temp = DEF_LIN_TL;
+        opts.fan[i].points.point[0].duty = DEF_LIN_DL;
+        opts.fan[i].points.point[1].temp = DEF_LIN_TU;
+        opts.fan[i].points.point[1].duty = DEF_LIN_DU;
+    }
+}
+
+static uint64_t now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void set_duty(uint8_t fan, uint8_t duty)
+{
+    // fan detection overrides any duty set
+    if (scanning) {
+        status.fan[fan].duty = SCAN_DUTY;
+        status.fan[fan].rpm = NSCAN;
+        return;
+    }
+
+    status.fan[fan].duty = duty;
+    if (fan < num_conn)
+        status.fan[fan].rpm = (uint32_t)max_rpm * duty / 100;
+    else
+        status.fan[fan].rpm = NCONN;
+}
+
+static void apply_opts();
+
+/**
+ * @brief Advance emulated fan curve generation according to elapsed time
+ */
+static void curve_update()
+{
+    if (curve_state != CURVE_RUNNING)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed = (now.tv_sec - curve_begin.tv_sec) * 1000 +
+                       (now.tv_nsec - curve_begin.tv_nsec) / 1000000;
+
+    uint64_t step = curve_ms ? elapsed / curve_ms : 100/CURVE_STEP + 1;
+    for (; curve_step < step && curve_step <= 100/CURVE_STEP; curve_step++) {
+        uint8_t duty = 100 - curve_step * CURVE_STEP;
+        curve_data.points[curve_step].duty = duty;
+        for (int f=0; f<NUM_FAN; f++)
+            curve_data.points[curve_step].rpm[f] = f < num_conn ?
+                (uint32_t)max_rpm * duty / 100 : 0;
+    }
+
+    if (curve_step > 100/CURVE_STEP) {
+        curve_state = CURVE_DONE;
+        apply_opts();
+    }
+}
+
+/**
+ * @brief Emulate one measurement cycle, i.e. sample sensors and apply linear
+ *        fan control
+ */
+static void measure()
+{
+    if (scanning && now_ms() >= scan_done) {
+        scanning = false;
+        apply_opts();
+    }
+    curve_update();
+
+    for (int i=0; i<NUM_TEMP; i++)
+        status.temp[i] = temps[i];
+    status.flags = now_ms() < eeprom_done ? STATUS_SAVING : 0;
+    for (int i=0; i<NUM_FAN; i++) {
+        if (curve_state == CURVE_RUNNING) {
+            set_duty(i, 100 - curve_step * CURVE_STEP);
+            continue;
+        }
+        if (opts.fan[i].mode == MODE_LINEAR)
+            set_duty(i, linear_duty(&opts.fan[i].param, &linear[i],
+                                    status.temp[opts.fan[i].sensor]));
+        else if (opts.fan[i].mode == MODE_POINTS)
+            set_duty(i, table_duty(table[i], opts.temp_unit,
+                                   status.temp[opts.fan[i].sensor]));
+        else
+            set_duty(i, status.fan[i].duty);
+    }
+}
+
+/**
+ * @brief Record emulated control cycles elapsed since the previous call
+ *
+ * Readings are taken once, i.e. all cycles recorded at once are the same.
+ */
+static void hist_update()
+{
+    uint64_t now = now_ms();
+    if (now < hist_next)
+        return;
+
+    measure();
+    for (; hist_next <= now; hist_next += opts.period)
+        hist_push(&hist, &status);
+}
+
+static void apply_opts()
+{
+    for (int i=0; i<NUM_FAN; i++) {
+        linear_prepare(&opts.fan[i].param, &linear[i]);
+        points_compile(&opts.fan[i].points, opts.temp_unit, table[i]);
+        if (opts.fan[i].mode == MODE_MANUAL)
+            set_duty(i, opts.fan[i].duty);
+    }
+}
+
+/**
+ * @brief Read exactly `len` bytes, giving up after `SERIAL_TIMO` like the
+ *        firmware's `Serial.readBytes()`
+ */
+static bool read_bytes(void *data, size_t len)
+{
+    struct pollfd pfd = { .fd = pty, .events = POLLIN };
+    size_t nread = 0;
+
+    while (nread < len) {
+        int ret = poll(&pfd, 1, SERIAL_TIMO);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        ssize_t n = read(pty, (char *)data+nread, len-nread);
+        if (n <= 0)
+            return false;
+        nread += n;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write `len` bytes, giving up after `SERIAL_TIMO` if nobody reads
+ */
+static bool write_bytes(const void *data, size_t len)
+{
+    struct pollfd pfd = { .fd = pty, .events = POLLOUT };
+    size_t nwritten = 0;
+
+    while (nwritten < len) {
+        ssize_t n = write(pty, (const char *)data+nwritten, len-nwritten);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN && poll(&pfd, 1, SERIAL_TIMO) > 0)
+            continue;
+        if (n <= 0)
+            return false;
+        nwritten += n;
+    }
+
+    return true;
+}
+
+static bool send_frame(uint8_t seq, uint8_t command, const void *payload,
+                       uint8_t len)
+{
+    header_t header = { .sof = SOF, .seq = seq, .cmd = command, .len = len };
+    uint8_t crc = crc8_update(crc8(&header, sizeof(header)), payload, len);
+
+    return write_bytes(&header, sizeof(header)) &&
+           (!len || write_bytes(payload, len)) &&
+           write_bytes(&crc, sizeof(crc));
+}
+
+static void reply(uint8_t seq, uint8_t command, const void *payload,
+                  uint8_t len)
+{
+    if (latency)
+        usleep(latency);
+
+    send_frame(seq, command, payload, len);
+}
+
+/**
+ * @brief Send periodic status if subscribed and due
+ *
+ * @return Time until next status is due (ms), -1 if not subscribed
+ */
+static int stream_run()
+{
+    if (!stream_int)
+        return -1;
+
+    uint64_t now = now_ms();
+    if (now >= stream_next) {
+        stream_next = now + stream_int;
+        measure();
+        // end subscription once the host stops reading, like the firmware
+        // does when the port is closed
+        if (!send_frame(0, CMD_STATUS_EVENT, &status, sizeof(status))) {
+            stream_int = 0;
+            return -1;
+        }
+    }
+
+    return stream_next - now;
+}
+
+/**
+ * @brief Execute setting command, same as the firmware's `apply_command()`
+ */
+static uint8_t apply_command(uint8_t command, const uint8_t *data)
+{
+    switch ((cmd_t)command) {
+        case CMD_FAN_MODE:
+        {
+            const msg_fan_mode_t *msg = (const msg_fan_mode_t *)data;
+            if (msg->fan < NUM_FAN && (msg->mode == MODE_MANUAL ||
+                                       msg->mode == MODE_LINEAR ||
+                                       msg->mode == MODE_POINTS)) {
+                opts.fan[msg->fan].mode = msg->mode;
+                apply_opts();
+                measure();
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_FAN_DUTY:
+        {
+            const msg_fan_duty_t *msg = (const msg_fan_duty_t *)data;
+            if (msg->fan < NUM_FAN && msg->duty <= 100) {
+                opts.fan[msg->fan].mode = MODE_MANUAL;
+                opts.fan[msg->fan].duty = msg->duty;
+                set_duty(msg->fan, msg->duty);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_FAN_MAP:
+        {
+            const msg_fan_map_t *msg = (const msg_fan_map_t *)data;
+            if (msg->fan < NUM_FAN && msg->sensor < NUM_TEMP) {
+                opts.fan[msg->fan].sensor = msg->sensor;
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_LINEAR:
+        {
+            const msg_fan_linear_t *msg = (const msg_fan_linear_t *)data;
+            if (msg->fan < NUM_FAN && msg->param.min_duty <= 100 &&
+                                      msg->param.max_duty <= 100) {
+                opts.fan[msg->fan].param = msg->param;
+                linear_prepare(&opts.fan[msg->fan].param, &linear[msg->fan]);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_POINTS:
+        {
+            const msg_fan_points_t *msg = (const msg_fan_points_t *)data;
+            if (msg->fan < NUM_FAN && points_valid(&msg->points)) {
+                opts.fan[msg->fan].points = msg->points;
+                points_compile(&msg->points, opts.temp_unit, table[msg->fan]);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_SUBSCRIBE:
+        {
+            const msg_subscribe_t *msg = (const msg_subscribe_t *)data;
+            if (msg->interval == 0 || msg->interval >= SINT_MIN) {
+                stream_int = msg->interval;
+                stream_next = now_ms() + stream_int;
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_PERIOD:
+        {
+            const msg_period_t *msg = (const msg_period_t *)data;
+            if (msg->period >= PERIOD_MIN && msg->period <= PERIOD_MAX) {
+                opts.period = msg->period;
+                timing_begin = now_ms();
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_SAVE:
+            eeprom = opts;
+            eeprom_valid = true;
+            eeprom_done = now_ms() + EEPROM_WRITE_MS;
+            return RESULT_OK;
+        case CMD_LOAD:
+            if (!eeprom_valid)
+                break;
+            opts = eeprom;
+            apply_opts();
+            return RESULT_OK;
+        default:
+            break;
+    }
+
+    return RESULT_ERR;
+}
+
+/**
+ * @brief Execute batch in place, same as the firmware's `apply_batch()`
+ */
+static uint8_t apply_batch(uint8_t *data)
+{
+    msg_batch_t batch = *(msg_batch_t *)data;
+    const uint8_t *entry = data + sizeof(msg_batch_t);
+    const uint8_t *end = entry + batch.len;
+
+    for (uint8_t i=0; i<batch.count; i++) {
+        uint8_t result = RESULT_ERR;
+        if (entry < end) {
+            uint8_t command = *entry++;
+            int len = command == CMD_BATCH ? -1 : request_len(command);
+            if (len < 0 || entry + len > end) {
+                entry = end;
+            } else {
+                result = apply_command(command, entry);
+                entry += len;
+            }
+        }
+        data[i] = result;
+    }
+
+    return batch.count;
+}
+
+static void handle_serial()
+{
+    header_t header = { .sof = 0 };
+    do {
+        if (!read_bytes(&header.sof, 1))
+            return;
+        if (header.sof != SOF && diag.dropped < UINT16_MAX)
+            diag.dropped++;
+    } while (header.sof != SOF);
+
+    if (!read_bytes(&header.seq, sizeof(header) - 1))
+        return;
+
+    uint8_t crc;
+    if (!read_bytes(buffer, header.len) || !read_bytes(&crc, 1) ||
+            crc != crc8_update(crc8(&header, sizeof(header)), buffer,
+                               header.len)) {
+        reply(header.seq, CMD_CHECKSUM, NULL, 0);
+        if (diag.errors < UINT16_MAX)
+            diag.errors++;
+        return;
+    }
+
+    // batch entries follow the batch header
+    int len = request_len(header.cmd);
+    if (header.cmd == CMD_BATCH && header.len >= len) {
+        msg_batch_t *batch = (msg_batch_t *)buffer;
+        len = batch->count > BATCH_LEN ? -1 : len + batch->len;
+    }
+    if (len < 0 || header.len != len) {
+        reply(header.seq, CMD_INVALID, NULL, 0);
+        if (diag.errors < UINT16_MAX)
+            diag.errors++;
+        return;
+    }
+    diag.phase[PHASE_SERIAL].count++;
+
+    curve_update();
+
+    size_t reply_len = 0;
+    const void *data = buffer;
+    switch ((cmd_t)header.cmd) {
+        case CMD_VERSION:
+            reply_len = sizeof(version_t);
+            data = &version;
+            break;
+        case CMD_STATUS:
+            measure();
+            reply_len = sizeof(status_t);
+            data = &status;
+            break;
+        case CMD_CONFIG:
+            reply_len = sizeof(config_t);
+            data = &opts;
+            break;
+        case CMD_FAN_MODE:
+        case CMD_FAN_DUTY:
+        case CMD_FAN_MAP:
+        case CMD_LINEAR:
+        case CMD_POINTS:
+        case CMD_SUBSCRIBE:
+        case CMD_PERIOD:
+        case CMD_SAVE:
+        case CMD_LOAD:
+            reply_len = 1;
+            buffer[0] = apply_command(header.cmd, buffer);
+            break;
+        case CMD_HISTORY:
+        {
+            hist_update();
+            msg_history_t msg;
+            uint16_t pos;
+            uint16_t len = hist_chunk(&hist,
+                                      ((msg_history_req_t *)buffer)->seq,
+                                      &msg, &pos);
+            msg.period = opts.period;
+            memcpy(buffer, &msg, sizeof(msg));
+            for (uint16_t i=0; i<len; i++)
+                buffer[sizeof(msg) + i] = hist.data[(pos + i) % HIST_LEN];
+            reply_len = sizeof(msg) + len;
+            break;
+        }
+        case CMD_TIMING:
+        {
+            // emulated control loop keeps its period perfectly
+            uint64_t now = now_ms();
+            uint64_t cycles = (now - timing_begin) / opts.period;
+            msg_timing_t *msg = (msg_timing_t *)buffer;
+            memset(msg, 0, sizeof(*msg));
+            msg->period = opts.period;
+            msg->cycles = cycles > UINT16_MAX ? UINT16_MAX : cycles;
+            timing_begin = now;
+            reply_len = sizeof(msg_timing_t);
+            break;
+        }
+        case CMD_DIAG:
+        {
+            // only requests are counted, stack and timing are not emulated
+            diag.uptime = now_ms() - boot;
+            memcpy(buffer, &diag, sizeof(diag));
+            memset(&diag, 0, sizeof(diag));
+            reply_len = sizeof(msg_diag_t);
+            break;
+        }
+        case CMD_BATCH:
+            reply_len = apply_batch(buffer);
+            break;
+        case CMD_FAN_CURVE:
+            reply_len = 1;
+            buffer[0] = RESULT_ERR;
+            if (curve_state != CURVE_RUNNING && !scanning) {
+                memset(&curve_data, 0, sizeof(curve_data));
+                clock_gettime(CLOCK_MONOTONIC, &curve_begin);
+                curve_state = CURVE_RUNNING;
+                curve_step = 0;
+                buffer[0] = RESULT_OK;
+            }
+            break;
+        case CMD_CURVE_STATE:
+        {
+            msg_curve_state_t *msg = (msg_curve_state_t *)buffer;
+            msg->state = curve_state;
+            msg->step = curve_step;
+            msg->steps = 100/CURVE_STEP + 1;
+            reply_len = sizeof(msg_curve_state_t);
+            break;
+        }
+        case CMD_CURVE_DATA:
+            reply_len = sizeof(msg_fan_curve_t);
+            data = &curve_data;
+            break;
+        case CMD_CURVE_STOP:
+            reply_len = 1;
+            buffer[0] = RESULT_ERR;
+            if (curve_state == CURVE_RUNNING) {
+                curve_state = CURVE_CANCELLED;
+                apply_opts();
+                buffer[0] = RESULT_OK;
+            }
+            break;
+        case CMD_RESET:
+            // device drops off the bus without replying
+            defaults();
+            stream_int = DEF_SINT;
+            scanning = true;
+            scan_done = now_ms() + SCAN_SETTLE;
+            boot = now_ms();
+            memset(&diag, 0, sizeof(diag));
+            if (eeprom_valid)
+                opts = eeprom;
+            apply_opts();
+            return;
+        default:
+            reply(header.seq, CMD_INVALID, NULL, 0);
+            return;
+    }
+
+    reply(header.seq, header.cmd, data, reply_len);
+}
+
+static bool pty_open()
+{
+    pty = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty < 0 || grantpt(pty) != 0 || unlockpt(pty) != 0 ||
+            fcntl(pty, F_SETFL, O_NONBLOCK) != 0) {
+        perror("Failed to allocate pseudo-terminal");
+        return false;
+    }
+
+    const char *path = ptsname(pty);
+    if (path == NULL) {
+        perror("Failed to determine pseudo-terminal name");
+        return false;
+    }
+
+    // keep the slave side open so the master does not see a hangup whenever
+    // a client disconnects, and put it into raw mode right away
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror("Failed to open pseudo-terminal");
+        return false;
+    }
+    struct termios tty;
+    if (tcgetattr(slave, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(slave, TCSANOW, &tty);
+    }
+
+    if (link_path) {
+        unlink(link_path);
+        if (symlink(path, link_path) != 0) {
+            perror("Failed to create symlink");
+            return false;
+        }
+    }
+
+    printf("%s\n", path);
+    fflush(stdout);
+
+    return true;
+}
+
+static void terminate(int sig)
+{
+    (void)sig;
+    if (link_path)
+        unlink(link_path);
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i=0; i<NUM_TEMP; i++)
+        temps[i] = 2500;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:r:t:l:c:p:h")) != -1) {
+        switch (c) {
+            case 'n':
+                num_conn = atoi(optarg);
+                if (num_conn > NUM_FAN) {
+                    fprintf(stderr, "Error: invalid fan count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                max_rpm = atoi(optarg);
+                break;
+            case 't':
+                if (!get_temps(optarg)) {
+                    fprintf(stderr, "Error: invalid temperature string\n");
+                    return 1;
+                }
+                break;
+            case 'l':
+                latency = atoi(optarg);
+                break;
+            case 'c':
+                curve_ms = atoi(optarg);
+                break;
+            case 'p':
+                link_path = optarg;
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                fprintf(stderr, "invalid argument(s). Try -h for help.\n");
+                return 1;
+        }
+    }
+
+    memset(&version, 0, sizeof(version));
+    strncpy(version.version, "fanboysim", STRL-1);
+    strncpy(version.build, __DATE__ " " __TIME__, STRL-1);
+
+    defaults();
+    scanning = true;
+    scan_done = now_ms() + SCAN_SETTLE;
+    timing_begin = now_ms();
+    boot = timing_begin;
+    hist_next = timing_begin + opts.period;
+    apply_opts();
+
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+
+    if (!pty_open())
+        return 1;
+
+    struct pollfd pfd = { .fd = pty, .events = POLLIN };
+    while (true) {
+        if (poll(&pfd, 1, stream_run()) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP)))
+            continue;
+        if (pfd.revents & POLLIN)
+            handle_serial();
+        else if (pfd.revents & (POLLERR | POLLHUP))
+            usleep(10000);
+    }
+
+    terminate(0);
+
+    return 0;
+}
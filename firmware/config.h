@@ -21,37 +21,47 @@
 #define TIMER13_TOP    320                    // Timer1/3 top value for 25 kHz PWM
 #define TIMER4_TOP     240                    // Timer4 top value for 25 kHz PWM
 
-#define UPDATE_INT     1000                   // Measurement interval (ms)
+#define UPDATE_INT     1000                   // Default control period (ms)
+#define PERIOD_MIN     100                    // Minimum control period (ms)
+#define PERIOD_MAX     10000                  // Maximum control period (ms)
+#define SCHED_TICK     1024                   // Timer0 compare period (us)
+#define SINT_MIN       100                    // Minimum status interval (ms)
 
 #define TMP_R          10000.0                // Sensor resistor (10 kOhm)
+#define ADC_OVERSMP    4                      // ADC oversampling (log2 of samples)
+#define ADC_FILTER     6                      // ADC moving average (log2 of weight)
+#define ADC_SETTLE     2                      // ADC samples dropped on channel switch
 
-#define RPM_TIMEOUT    500000                 // RPM pulse detection timeout (us)
-#define RPM_TMIN       3000                   // Minimum valid RPM pulse length (us)
-#define RPM_SNUM       2                      // No. of samples for RPM measurement
-#define RPM_RETRIES    2                      // No. of retries for RPM measurement
+#define RPM_TIMEOUT    500000                 // Maximum valid RPM signal period (us)
+#define RPM_TMIN       3000                   // Minimum valid RPM signal period (us)
 
 #define DEF_UNIT       DEG_C                  // Default temperature unit (C)
 #define DEF_MODE       MODE_MANUAL            // Default operation mode
 #define DEF_DUTY       50                     // Default fixed fan duty (%)
-#define DEF_SINT       0                      // Default status interval (s)
+#define DEF_SINT       0                      // Default status interval (ms, 0: off)
 #define DEF_MAP        0                      // Default sensor mapping
 #define DEF_LIN_TL     2000                   // Default linear lower temperature
 #define DEF_LIN_TU     4000                   // Default linear upper temperature
 #define DEF_LIN_DL     33                     // Default linear lower duty (%)
 #define DEF_LIN_DU     80                     // Default linear upper duty (%)
 
+#define NUM_POINTS     8                      // Max. points per multi-point curve
+#define TABLE_TMAX     100                    // Duty table range (0-N deg C)
+
 #define SCAN_DUTY      50                     // Fan scan duty (%)
 #define SCAN_SETTLE    2000                   // Fan scan settle delay (ms)
-#define SCAN_TRIES     3                      // Fan scan tries per channel
+
+#define HIST_LEN       384                    // History ring buffer size (bytes)
+
+#define STACK_CANARY   0xc5                   // Stack painting pattern
 
 #define EEPROM_MAGIC   0xFB                   // Settings record start byte
-#define EEPROM_GOFFS   15                     // Offset of generation indicator
 #define EEPROM_LEN     1024                   // 1 kB EEPROM on Leonardo
 
 #define CURVE_STEP     10                     // Curve duty step size (%)
 #define CURVE_SDELAY   5000                   // Curve settle delay (ms)
 #define CURVE_SMPNUM   3                      // Curve sample num per duty
-#define CURVE_SMPDEL   50                     // Curve delay between samples (ms)
+#define CURVE_SMPDEL   250                    // Curve sample window (ms)
 
 #ifndef VERSION
 #define VERSION        "unknown"              // Fallback version string
@@ -64,8 +74,8 @@
 #define FOREACH_FAN(V)        FOREACH_U8(V, NUM_FAN)
 #define FOREACH_TEMP(V)       FOREACH_U8(V, NUM_TEMP)
 
-#define EEPROM_GEN_NUM        ((EEPROM_LEN - EEPROM_GOFFS-1) / sizeof(eeprom_t))
-#define EEPROM_OPT_OFFS(GEN)  (EEPROM_GOFFS + 1 + GEN * sizeof(eeprom_t))
+#define EEPROM_SLOTS          (EEPROM_LEN / sizeof(eeprom_t))
+#define EEPROM_SLOT_OFFS(S)   ((S) * sizeof(eeprom_t))
 
 #endif
 
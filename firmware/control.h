@@ -0,0 +1,216 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of the MIT
+ * License, see file 'LICENSE'.
+ */
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+/**
+ * @file
+ * @brief Integer arithmetic for automatic fan control modes
+ *
+ * Shared by the firmware and host-side tools (e.g. the simulator), so both
+ * compute exactly the same duty values.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "serial.h"
+
+
+/**
+ * @brief Precomputed parameters for linear fan control
+ *
+ * Duty slope `d_span / t_span` split into integer part and fractional part,
+ * the latter as 0.32 fixed-point reciprocal rounded up. @see linear_prepare()
+ */
+typedef struct {
+    uint16_t  t_span;       //< temperature span (0: step function)
+    uint16_t  d_rem;        //< `d_span % t_span`
+    uint32_t  d_frac;       //< `d_rem / t_span` as 0.32 fixed-point
+    uint8_t   d_int;        //< `d_span / t_span`
+    uint8_t   falling;      //< non-zero if `max_duty < min_duty`
+} linear_fp_t;
+
+
+/**
+ * @brief Fan duty lookup table compiled from a multi-point curve
+ *
+ * One entry per degree Celsius from 0 to `TABLE_TMAX`, independent of the
+ * configured temperature unit. @see points_compile()
+ */
+typedef uint8_t duty_table_t[TABLE_TMAX + 1];
+
+
+/**
+ * @brief Precompute fixed-point parameters for linear fan control
+ *
+ * Needs to be called whenever the linear control parameters change.
+ *
+ * @param[in]  param  Linear control parameters
+ * @param[out] fp     Precomputed parameters
+ */
+static inline void linear_prepare(const linear_t *param, linear_fp_t *fp)
+{
+    fp->falling = param->max_duty < param->min_duty;
+    uint8_t d_span = fp->falling ? param->min_duty - param->max_duty :
+                                   param->max_duty - param->min_duty;
+
+    fp->t_span = 0;
+    fp->d_rem = 0;
+    fp->d_frac = 0;
+    fp->d_int = 0;
+    if (param->max_temp <= param->min_temp)
+        return;
+
+    fp->t_span = param->max_temp - param->min_temp;
+    fp->d_int = d_span / fp->t_span;
+    fp->d_rem = d_span % fp->t_span;
+
+    // ceil(2^32 * d_rem / t_span) by long division in 16 bit digits
+    uint32_t num = (uint32_t)fp->d_rem << 16;
+    uint32_t hi = num / fp->t_span;
+    num = (num % fp->t_span) << 16;
+    uint32_t lo = num / fp->t_span;
+    fp->d_frac = (hi << 16 | lo) + (num % fp->t_span ? 1 : 0);
+}
+
+/**
+ * @brief Compute duty for linear fan control
+ *
+ * Result is identical to evaluating the linear equation in floating point
+ * and truncating towards zero. The fractional part of the slope is applied
+ * using a 16x32 bit high multiplication, which is exact for all
+ * `x < t_span <= 65535`.
+ *
+ * @param[in] param  Linear control parameters
+ * @param[in] fp     Precomputed parameters, @see linear_prepare()
+ * @param     temp   Current temperature (*100 deg)
+ *
+ * @return Fan duty in percent
+ */
+static inline uint8_t linear_duty(const linear_t *param, const linear_fp_t *fp,
+                                  uint16_t temp)
+{
+    if (temp <= param->min_temp)
+        return param->min_duty;
+    if (temp >= param->max_temp || fp->t_span == 0)
+        return param->max_duty;
+
+    uint16_t x = temp - param->min_temp;
+    uint32_t prod = x * (fp->d_frac >> 16) +
+                    ((x * (fp->d_frac & 0xffff)) >> 16);
+    uint16_t frac = prod >> 16;
+    uint8_t steps = x * fp->d_int + frac;
+
+    if (!fp->falling)
+        return param->min_duty + steps;
+
+    // round up on falling slope, i.e. truncate the final value towards zero
+    if ((uint32_t)frac * fp->t_span != (uint32_t)x * fp->d_rem)
+        steps++;
+
+    return param->min_duty - steps;
+}
+
+/**
+ * @brief Check multi-point fan control curve
+ *
+ * @param[in] points  Multi-point curve
+ *
+ * @return true if point count, order and duties are valid
+ */
+static inline bool points_valid(const points_t *points)
+{
+    if (points->count < 1 || points->count > NUM_POINTS)
+        return false;
+
+    for (uint8_t i=0; i<points->count; i++) {
+        if (points->point[i].duty > 100)
+            return false;
+        if (i && points->point[i].temp <= points->point[i-1].temp)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Compute duty of multi-point curve
+ *
+ * Interpolates between the neighbouring points, truncating the result towards
+ * zero like `linear_duty()`.
+ *
+ * @param[in] points  Multi-point curve, @see points_valid()
+ * @param     temp    Temperature (*100 deg)
+ *
+ * @return Fan duty in percent
+ */
+static inline uint8_t points_duty(const points_t *points, uint16_t temp)
+{
+    const point_t *p = points->point;
+    if (temp <= p[0].temp)
+        return p[0].duty;
+
+    for (uint8_t i=1; i<points->count; i++) {
+        if (temp >= p[i].temp)
+            continue;
+
+        uint16_t span = p[i].temp - p[i-1].temp;
+        uint16_t x = temp - p[i-1].temp;
+        int32_t num = (int32_t)p[i-1].duty * span +
+                      ((int32_t)p[i].duty - p[i-1].duty) * x;
+        return num / span;
+    }
+
+    return p[points->count-1].duty;
+}
+
+/**
+ * @brief Compile multi-point curve into duty table
+ *
+ * Needs to be called whenever the curve or the temperature unit changes.
+ *
+ * @param[in]  points  Multi-point curve, @see points_valid()
+ * @param      unit    Temperature unit of the curve (@see temp_unit_t)
+ * @param[out] table   Duty table
+ */
+static inline void points_compile(const points_t *points, uint8_t unit,
+                                  duty_table_t table)
+{
+    for (uint8_t i=0; i<=TABLE_TMAX; i++) {
+        uint16_t temp = unit == DEG_F ? i * 180 + 3200 : i * 100;
+        table[i] = points_duty(points, temp);
+    }
+}
+
+/**
+ * @brief Look up duty for temperature in duty table
+ *
+ * Uses the entry of the nearest degree Celsius, temperatures beyond the table
+ * (including `NCONN`) use its last entry.
+ *
+ * @param[in] table  Duty table, @see points_compile()
+ * @param     unit   Temperature unit of `temp` (@see temp_unit_t)
+ * @param     temp   Current temperature (*100 deg)
+ *
+ * @return Fan duty in percent
+ */
+static inline uint8_t table_duty(const duty_table_t table, uint8_t unit,
+                                 uint16_t temp)
+{
+    uint32_t i;
+    if (unit == DEG_F)
+        i = temp < 3200 ? 0 : ((uint32_t)(temp - 3200) * 5 + 450) / 900;
+    else
+        i = ((uint32_t)temp + 50) / 100;
+
+    return table[i < TABLE_TMAX ? i : TABLE_TMAX];
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 et */
@@ -7,6 +7,7 @@
 #ifndef _DECL_H
 #define _DECL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "serial.h"
@@ -15,45 +16,211 @@
 /**
  * @brief Integrity shell for saving/loading settings to/from EEPROM
  *
+ * Records form a journal written round-robin across all of EEPROM, the valid
+ * record with the highest sequence no. holds the current settings.
+ *
  *   magic:  Predefined magic constant for fast record checking
+ *   seq:    Sequence no., incremented for every record written
  *   opts:   Settings structure, @see config_t
- *   crc:    CRC8 covering `opts`
+ *   crc:    CRC8 covering `seq` and `opts`, @see crc8.h
  */
 struct eeprom_t
 {
     uint8_t       magic;
+    uint16_t      seq;
     config_t      opts;
     uint8_t       crc;
 };
 
 /**
- * @brief CRC8 helper function
- * 
- * Used to protect settings stored in EEPROM from bit-rot.
- * 
- * @param[in]  data  Pointer to beginning of data to cover
- * @param      len   Number of bytes to cover
- * @returns    8-bit check value for given data
+ * @brief Edge detection mechanism used for a fan's RPM signal
+ */
+enum tach_mode_t
+{
+    TACH_INT,       //< external interrupt
+    TACH_PCINT,     //< pin change interrupt
+    TACH_POLL       //< polled by scheduler tick (pin lacks interrupt support)
+};
+
+/**
+ * @brief Tachometer state of a single fan
+ *
+ *   last:   Timestamp of the latest accepted falling edge (us)
+ *   sum:    Sum of signal periods since last read-out (us)
+ *   count:  Number of signal periods summed up in `sum`
+ *   port:   Input register of RPM pin
+ *   mask:   Bit mask of RPM pin in `port`
+ *   level:  Last seen level of RPM pin (pin change/polled detection only)
+ *   mode:   Edge detection mechanism, @see tach_mode_t
+ */
+struct tach_t
+{
+    volatile uint32_t  last;
+    volatile uint32_t  sum;
+    volatile uint16_t  count;
+    volatile uint8_t  *port;
+    uint8_t            mask;
+    uint8_t            level;
+    tach_mode_t        mode;
+};
+
+/**
+ * @brief Fan curve generation progress
+ *
+ *   state:   Generation state, @see curve_state_t
+ *   step:    Current duty step
+ *   sample:  Samples taken in current step (0: settling)
+ *   next:    Timestamp of next sample (ms)
+ *   rpm:     Sum of samples taken in current step, per fan
+ *   data:    Curve points sampled so far
+ */
+struct curve_t
+{
+    uint8_t          state;
+    uint8_t          step;
+    uint8_t          sample;
+    uint32_t         next;
+    uint32_t         rpm[NUM_FAN];
+    msg_fan_curve_t  data;
+};
+
+/**
+ * @brief Control loop scheduler state
+ *
+ *   period:     Control period (us)
+ *   elapsed:    Time accumulated since the latest due tick (us)
+ *   due:        Control cycle due, set by timer interrupt
+ *   tick:       Timestamp of the tick making the cycle due (us)
+ *   last:       Start of the previous control cycle (us)
+ *   delay_sum:  Sum of delays of all cycles in `stats`
+ *   stats:      Statistics since the previous query, @see msg_timing_t
+ */
+struct sched_t
+{
+    volatile uint32_t  period;
+    uint32_t           elapsed;
+    volatile bool      due;
+    volatile uint32_t  tick;
+    uint32_t           last;
+    uint32_t           delay_sum;
+    msg_timing_t       stats;
+};
+
+/**
+ * @brief Timing of a firmware phase being accumulated
+ *
+ *   count:  Number of runs
+ *   sum:    Sum of durations of the latest `n` runs (us, capped at 16 bits)
+ *   n:      Number of runs summed up in `sum`, both halved when full
+ *   max:    Maximum duration (us)
+ */
+struct phase_acc_t
+{
+    uint32_t  count;
+    uint32_t  sum;
+    uint16_t  n;
+    uint16_t  max;
+};
+
+/**
+ * @brief Self-diagnostics since the previous query, @see msg_diag_t
+ *
+ *   phase:    Timing per phase, @see phase_t
+ *   dropped:  Bytes dropped scanning for start of frame
+ *   errors:   Frames failing checksum or length check
+ */
+struct diag_t
+{
+    phase_acc_t  phase[NUM_PHASE];
+    uint16_t     dropped;
+    uint16_t     errors;
+};
+
+/**
+ * @brief Free-running ADC state for temperature sensors
+ *
+ * Readings are 10-bit ADC values with `ADC_OVERSMP` fractional bits gained by
+ * oversampling, filtered by an exponentially weighted moving average.
+ *
+ *   acc:     Filtered reading per sensor, multiplied by 2^ADC_FILTER
+ *   chan:    ADC channel per sensor
+ *   primed:  Bit mask of sensors holding a filtered reading
+ *   sensor:  Sensor currently sampled
+ *   sum:     Sum of samples taken of `sensor` so far
+ *   count:   Number of samples summed up in `sum`
+ *   skip:    Samples left to drop after switching channels
+ */
+struct adc_t
+{
+    volatile uint32_t  acc[NUM_TEMP];
+    uint8_t            chan[NUM_TEMP];
+    volatile uint8_t   primed;
+    uint8_t            sensor;
+    uint16_t           sum;
+    uint8_t            count;
+    uint8_t            skip;
+};
+
+/**
+ * @brief Set up edge detection for all fan RPM signals
+ *
+ * Uses an external interrupt where available for the pin, falls back to pin
+ * change interrupts and eventually to polling via `tach_poll()`.
  */
-uint8_t crc8(const uint8_t *data, uint16_t len);
+void tach_init();
+
+/**
+ * @brief Account falling edge of a fan's RPM signal
+ *
+ * Adds the period since the previous edge to the fan's accumulator. Periods
+ * shorter than `RPM_TMIN` are treated as glitches and ignored, periods longer
+ * than `RPM_TIMEOUT` restart the measurement.
+ *
+ * @param  fan  Fan no.
+ */
+void tach_edge(uint8_t fan);
+
+/**
+ * @brief Check polled RPM signals for falling edges
+ *
+ * Called from the scheduler tick, i.e. every `SCHED_TICK` us, which resolves
+ * RPM signals of up to about 14000 RPM (two pulses per revolution).
+ */
+void tach_poll();
 
 /**
  * @brief Determine current fan RPM
- * 
- * Uses Arduino's `pulseIn()` mechanism to measure the length of the LOW-pulse
- * emitted by the Hall sensor of the fan.
- * 
+ *
+ * Averages all signal periods accumulated since the previous call, i.e. the
+ * result covers the time in between. Runs in constant time.
+ *
  * @param    fan  Fan no.
- * @returns  Current fan speed in RPM
- * @note     This function can take a considerable amount of time
- *           (waiting for the next LOW pulse), avoid calling it for
- *           unconnected fans.
+ * @returns  Fan speed in RPM, 0 if no valid signal period has been seen
  */
 uint16_t get_rpm(uint8_t fan);
 
+/**
+ * @brief Start free-running conversions of all sensors
+ *
+ * The ADC interrupt cycles through all sensors, taking 2^ADC_OVERSMP samples
+ * of each before switching to the next one.
+ */
+void adc_init();
+
+/**
+ * @brief Read latest filtered sensor value
+ *
+ * @param    sensor  Sensor no.
+ * @returns  ADC value with `ADC_OVERSMP` fractional bits, 0 if not sampled yet
+ */
+uint16_t adc_read(uint8_t sensor);
+
 /**
  * @brief Determine current sensor temperature
- * 
+ *
+ * Interpolates the filtered ADC reading between entries of the lookup tables
+ * generated from the Steinhart-Hart equation by `thermistor.py`.
+ *
  * @param    sensor  Sensor no.
  * @returns  Current temperature multiplied by 100 as integer
  */
@@ -84,12 +251,38 @@ void set_duty(uint8_t fan, uint8_t value);
  *          +---------|-----|---------> Temperature
  *                  t_min  t_max
  *
+ * Evaluated in integer arithmetic using the parameters precomputed by
+ * `linear_prepare()`, @see control.h
+ *
  * @param  fan  Fan no.
  */
 void set_duty_linear(uint8_t fan);
 
+/**
+ * @brief Set duty according to multi-point control curve for given fan
+ *
+ * Looks up the duty for the mapped sensor's temperature in the fan's duty
+ * table compiled from its curve, @see points_compile()
+ *
+ * @param  fan  Fan no.
+ */
+void set_duty_points(uint8_t fan);
+
+/**
+ * @brief Find newest valid settings record in EEPROM
+ *
+ * Scans the journal once at boot, remembering the slot for `opts_load()` and
+ * `opts_save()`. Records failing the checksum (e.g. interrupted writes) are
+ * skipped, so the previous settings remain available.
+ */
+void opts_scan();
+
 /**
  * @brief Save current settings to EEPROM
+ *
+ * Writes a new record to the slot following the newest one, which spreads
+ * wear evenly across all of EEPROM. Returns immediately, the record is
+ * written from the EEPROM-ready interrupt while `STATUS_SAVING` is set.
  */
 void opts_save();
 
@@ -101,25 +294,191 @@ void opts_save();
 bool opts_load();
 
 /**
- * @brief Detect connected fans
+ * @brief Start detection of connected fans
  * 
- * Ramps up all fans to fixed duty (`SCAN_DUTY`) and checks for valid RPM
- * signal. Marks fans without the latter as unconnected. This is used to save
- * execution time consumed by unnecessary calls to `get_rpm()`.
+ * Ramps up all fans to fixed duty (`SCAN_DUTY`) and reports their RPM as
+ * `NSCAN` until detection has finished, @see fan_scan_run()
+ *
+ * @param  now  Current timestamp (ms)
+ */
+void fan_scan_start(uint32_t now);
+
+/**
+ * @brief Finish fan detection once due
+ *
+ * Checks for valid RPM signal after `SCAN_SETTLE`, marks fans without the
+ * latter as unconnected and applies the configured settings.
+ *
+ * @param  now  Current timestamp (ms)
+ */
+void fan_scan_run(uint32_t now);
+
+/**
+ * @brief Send periodic status frame if due
+ *
+ * Sends `CMD_STATUS_EVENT` every `stream_int` ms as requested by the host via
+ * `CMD_SUBSCRIBE`. Ends the subscription once the host closes the port.
+ *
+ * @param  now  Current timestamp (ms)
  */
-void fan_scan();
+void stream_run(uint32_t now);
 
 /**
- * @brief Detect connected fans
+ * @brief Apply configured mode and duty to fan
+ *
+ * Does nothing while fans are being detected or fan curves are being
+ * generated, settings are applied once either has finished.
+ *
+ * @param  fan  Fan no.
+ */
+void fan_apply(uint8_t fan);
+
+/**
+ * @brief Start fan curve generation
  * 
  * Determines fan characteristic by ramping duty values from 100% down to 0% in
- * `CURVE_STEP`% steps, taking `CURVE_SAMPLE_NUM` samples of the fan RPM. Saves
- * measured RPM values in serial buffer.
+ * `CURVE_STEP`% steps, taking `CURVE_SMPNUM` samples of the fan RPM after
+ * `CURVE_SDELAY` each. Sampling is done in the background by `curve_run()`.
+ *
+ * @returns  `true` on success, `false` if generation is already in progress
+ *           or fans are still being detected
+ */
+bool curve_start();
+
+/**
+ * @brief Advance fan curve generation
+ *
+ * Called from `loop()`, takes the next sample or moves on to the next duty
+ * step once due.
+ *
+ * @param  now  Current timestamp (ms)
+ */
+void curve_run(uint32_t now);
+
+/**
+ * @brief Stop fan curve generation and restore fan settings
+ *
+ * @param  state  Final state, `CURVE_DONE` or `CURVE_CANCELLED`
  */
-void fan_curve();
+void curve_stop(uint8_t state);
+
+/**
+ * @brief Start control loop scheduler
+ *
+ * Uses the compare match B interrupt of Timer0, which runs anyway for
+ * `millis()` and is not used for fan PWM. The interrupt fires every
+ * `SCHED_TICK` us and marks a control cycle due whenever a period has
+ * accumulated, so the period does not drift with the time spent in `loop()`.
+ */
+void sched_init();
+
+/**
+ * @brief Set control period
+ *
+ * @param    period  Period in ms (`PERIOD_MIN`-`PERIOD_MAX`)
+ * @returns  `true` on success, `false` if out of range
+ */
+bool sched_set_period(uint16_t period);
+
+/**
+ * @brief Check whether a control cycle is due and account its timing
+ *
+ * @returns  `true` if the control cycle has to run now
+ */
+bool sched_poll();
+
+/**
+ * @brief Get timing statistics and start over
+ *
+ * @param[out]  stats  Statistics since the previous call
+ */
+void sched_stats(msg_timing_t *stats);
+
+/**
+ * @brief Account run of firmware phase
+ *
+ * @param  phase  Phase, @see phase_t
+ * @param  start  Start of run (us, as returned by `micros()`)
+ */
+void diag_phase(uint8_t phase, uint32_t start);
+
+/**
+ * @brief Determine stack headroom
+ *
+ * Counts the bytes above static data still holding `STACK_CANARY`, as painted
+ * at boot.
+ *
+ * @returns  Number of bytes never used by the stack
+ */
+uint16_t stack_free();
+
+/**
+ * @brief Get self-diagnostics and start over
+ *
+ * @param[out]  stats  Diagnostics since the previous call
+ */
+void diag_stats(msg_diag_t *stats);
+
+/**
+ * @brief Run control cycle, i.e. sample sensors and fans and update duties
+ *
+ * Readings are recorded in the history, @see history.h
+ */
+void control_step();
+
+/**
+ * @brief Execute setting command
+ *
+ * Handles all commands replying with `msg_result_t`, both received on their
+ * own and as part of a batch.
+ *
+ * @param      command  Command byte, @see cmd_t
+ * @param[in]  data     Command payload
+ *
+ * @return `RESULT_OK` on success, `RESULT_ERR` otherwise (also for commands
+ *         not handled)
+ */
+uint8_t apply_command(uint8_t command, const char *data);
+
+/**
+ * @brief Execute batch of setting commands
+ *
+ * Replaces the batch in place by the result of each entry. Entries following
+ * a malformed one fail as well.
+ *
+ * @param[in,out] data  `msg_batch_t` followed by entries
+ *
+ * @return No. of results
+ */
+uint8_t apply_batch(char *data);
+
+/**
+ * @brief Send frame via serial interface
+ *
+ * Writes header, payload and CRC8 covering both.
+ *
+ * @param      seq      Sequence no. of request replied to (0: unsolicited)
+ * @param      command  Command byte, @see cmd_t
+ * @param[in]  data     Payload
+ * @param      len      Payload length in bytes
+ */
+void send_frame(uint8_t seq, uint8_t command, const void *data, uint8_t len);
+
+/**
+ * @brief Send reply to `CMD_HISTORY` request
+ *
+ * Records are sent straight from the ring buffer, i.e. without copying.
+ *
+ * @param  seq   Sequence no. of request replied to
+ * @param  from  Cycle no. of first record requested
+ */
+void hist_send(uint8_t seq, uint16_t from);
 
 /**
  * @brief Handle serial communication
+ *
+ * Receives a single request frame, verifies its checksum and length and
+ * replies.
  */
 void handle_serial();
 
@@ -0,0 +1,290 @@
+/* Copyright (c) 2020 Alexander Koch
+ *
+ * This file is part of a project that is distributed under the terms of the MIT
+ * License, see file 'LICENSE'.
+ */
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+/**
+ * @file
+ * @brief Delta-encoded history of measurement cycles
+ *
+ * Shared by the firmware, the simulator (both recording) and libfanboy
+ * (decoding). Each record holds the readings of one control cycle as changes
+ * against the previous cycle:
+ *
+ *   uint16_t  mask   bit i set if field i changed, @see hist_get()
+ *   varint    delta  per changed field (in order): difference to previous
+ *                    value modulo 2^16, zigzag encoded, 7 bits per byte
+ *                    starting with the least significant ones, MSB set if
+ *                    more bytes follow
+ *
+ * RPMs and temperatures are only recorded once they deviate from the value
+ * recorded before by more than a deadband, so readings steady but for
+ * measurement noise take just the mask instead of `status_t`.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "serial.h"
+
+#define HIST_FIELDS   (2 * NUM_FAN + NUM_TEMP)   // fields per record (max. 16)
+#define HIST_REC_MAX  (2 + 3 * HIST_FIELDS)      // max. record length
+#define HIST_DB_RPM   50        // RPM deadband (RPM)
+#define HIST_DB_TEMP  20        // temperature deadband (*100 deg)
+
+
+/**
+ * @brief History ring buffer
+ *
+ * Oldest records are dropped as new ones need their space. `base` is kept up
+ * to date by applying each record dropped, so the ring can always be decoded.
+ *
+ *   data:   Records, wrapping around at `HIST_LEN`
+ *   head:   Offset of oldest record in `data`
+ *   len:    Bytes used in `data`
+ *   seq:    Cycle no. of oldest record
+ *   count:  No. of records held
+ *   base:   Readings preceding oldest record
+ *   last:   Readings as of newest record (as recorded, @see hist_encode())
+ */
+typedef struct {
+    uint8_t   data[HIST_LEN];
+    uint16_t  head;
+    uint16_t  len;
+    uint16_t  seq;
+    uint16_t  count;
+    status_t  base;
+    status_t  last;
+} hist_t;
+
+
+/**
+ * @brief Get field of readings by index
+ *
+ * Fields are fan duties, fan RPMs and temperatures, in that order.
+ */
+static inline uint16_t hist_get(const status_t *values, uint8_t field)
+{
+    if (field < NUM_FAN)
+        return values->fan[field].duty;
+    if (field < 2 * NUM_FAN)
+        return values->fan[field - NUM_FAN].rpm;
+
+    return values->temp[field - 2 * NUM_FAN];
+}
+
+/**
+ * @brief Set field of readings by index, @see hist_get()
+ */
+static inline void hist_set(status_t *values, uint8_t field, uint16_t value)
+{
+    if (field < NUM_FAN)
+        values->fan[field].duty = value;
+    else if (field < 2 * NUM_FAN)
+        values->fan[field - NUM_FAN].rpm = value;
+    else
+        values->temp[field - 2 * NUM_FAN] = value;
+}
+
+/**
+ * @brief Get deadband of field, @see hist_get()
+ */
+static inline uint16_t hist_deadband(uint8_t field)
+{
+    if (field < NUM_FAN)
+        return 0;
+    if (field < 2 * NUM_FAN)
+        return HIST_DB_RPM;
+
+    return HIST_DB_TEMP;
+}
+
+/**
+ * @brief Encode readings as record
+ *
+ * Changes within a field's deadband are not recorded. Duties as well as
+ * changes from or to 0, `NSCAN` and `NCONN` are always recorded exactly.
+ *
+ * @param[in,out] prev    Readings recorded before, updated to the record's
+ * @param[in]     values  Readings of current cycle
+ * @param[out]    rec     Record, at least `HIST_REC_MAX` bytes
+ *
+ * @return Record length in bytes
+ */
+static inline uint8_t hist_encode(status_t *prev, const status_t *values,
+                                  uint8_t *rec)
+{
+    uint16_t mask = 0;
+    uint8_t len = 2;
+
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        uint16_t old = hist_get(prev, i);
+        uint16_t value = hist_get(values, i);
+        if (value == old)
+            continue;
+
+        uint16_t diff = value > old ? value - old : old - value;
+        bool exact = !old || !value || old >= NSCAN || value >= NSCAN;
+        if (!exact && diff <= hist_deadband(i))
+            continue;
+
+        uint16_t delta = value - old;
+        hist_set(prev, i, value);
+        mask |= (uint16_t)1 << i;
+
+        uint16_t zz = (delta << 1) ^ (delta & 0x8000 ? 0xffff : 0);
+        while (zz >= 0x80) {
+            rec[len++] = (zz & 0x7f) | 0x80;
+            zz >>= 7;
+        }
+        rec[len++] = zz;
+    }
+    rec[0] = mask & 0xff;
+    rec[1] = mask >> 8;
+
+    return len;
+}
+
+/**
+ * @brief Determine length of record in ring buffer
+ *
+ * @param[in] data  Ring buffer
+ * @param     size  Ring buffer size
+ * @param     pos   Offset of record in `data`
+ *
+ * @return Record length in bytes
+ */
+static inline uint8_t hist_reclen(const uint8_t *data, uint16_t size,
+                                  uint16_t pos)
+{
+    uint16_t mask = data[pos % size] | (uint16_t)data[(pos + 1) % size] << 8;
+    uint8_t len = 2;
+
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        if (!(mask & ((uint16_t)1 << i)))
+            continue;
+
+        // deltas take up to 3 bytes
+        uint8_t n = 0;
+        while ((data[(pos + len++) % size] & 0x80) && ++n < 3)
+            ;
+    }
+
+    return len;
+}
+
+/**
+ * @brief Apply record in ring buffer to readings
+ *
+ * @param[in]     data    Ring buffer
+ * @param         size    Ring buffer size
+ * @param         pos     Offset of record in `data`
+ * @param[in,out] values  Readings of previous cycle, updated to record's
+ *
+ * @return Record length in bytes
+ */
+static inline uint8_t hist_decode(const uint8_t *data, uint16_t size,
+                                  uint16_t pos, status_t *values)
+{
+    uint16_t mask = data[pos % size] | (uint16_t)data[(pos + 1) % size] << 8;
+    uint8_t len = 2;
+
+    for (uint8_t i=0; i<HIST_FIELDS; i++) {
+        if (!(mask & ((uint16_t)1 << i)))
+            continue;
+
+        uint16_t zz = 0;
+        uint8_t shift = 0, byte;
+        do {
+            byte = data[(pos + len++) % size];
+            zz |= (uint16_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while ((byte & 0x80) && shift < 16);
+
+        uint16_t delta = (zz >> 1) ^ (zz & 1 ? 0xffff : 0);
+        hist_set(values, i, hist_get(values, i) + delta);
+    }
+
+    return len;
+}
+
+/**
+ * @brief Append readings to history, dropping oldest records as needed
+ *
+ * @param[in,out] hist    History
+ * @param[in]     values  Readings of current cycle
+ */
+static inline void hist_push(hist_t *hist, const status_t *values)
+{
+    uint8_t rec[HIST_REC_MAX];
+    uint8_t len = hist_encode(&hist->last, values, rec);
+
+    while (HIST_LEN - hist->len < len) {
+        uint8_t drop = hist_decode(hist->data, HIST_LEN, hist->head,
+                                   &hist->base);
+        hist->head = (hist->head + drop) % HIST_LEN;
+        hist->len -= drop;
+        hist->seq++;
+        hist->count--;
+    }
+
+    uint16_t pos = (hist->head + hist->len) % HIST_LEN;
+    for (uint8_t i=0; i<len; i++) {
+        hist->data[pos] = rec[i];
+        if (++pos == HIST_LEN)
+            pos = 0;
+    }
+    hist->len += len;
+    hist->count++;
+}
+
+/**
+ * @brief Prepare reply to history request
+ *
+ * Determines the records to send for the cycle no. requested, as many as fit
+ * into `HIST_CHUNK` bytes. Starts with the oldest record if the one requested
+ * is not held (anymore). Sets all fields of `msg` except `period`.
+ *
+ * @param[in]  hist  History
+ * @param      seq   Cycle no. of first record requested
+ * @param[out] msg   Reply header
+ * @param[out] pos   Offset of first record in `hist->data`
+ *
+ * @return Length of records in bytes
+ */
+static inline uint16_t hist_chunk(const hist_t *hist, uint16_t seq,
+                                  msg_history_t *msg, uint16_t *pos)
+{
+    uint16_t skip = seq - hist->seq;
+    if (skip > hist->count)
+        skip = 0;
+
+    msg->base = hist->base;
+    msg->base.flags = 0;
+    *pos = hist->head;
+    for (uint16_t i=0; i<skip; i++)
+        *pos = (*pos + hist_decode(hist->data, HIST_LEN, *pos, &msg->base)) %
+               HIST_LEN;
+
+    uint16_t len = 0;
+    msg->seq = hist->seq + skip;
+    msg->end = hist->seq + hist->count;
+    msg->count = 0;
+    while (skip + msg->count < hist->count) {
+        uint8_t n = hist_reclen(hist->data, HIST_LEN, *pos + len);
+        if (len + n > HIST_CHUNK)
+            break;
+        len += n;
+        msg->count++;
+    }
+
+    return len;
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 et */
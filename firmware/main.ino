@@ -6,10 +6,15 @@
 
 #include <EEPROM.h>
 #include <avr/wdt.h>
+#include <util/atomic.h>
 
 #include "config.h"
 #include "serial.h"
 #include "decl.h"
+#include "control.h"
+#include "crc8.h"
+#include "history.h"
+#include "thermistor.h"
 
 static const uint8_t pins_pwm[NUM_FAN] = PINS_PWM;
 static const uint8_t pins_rpm[NUM_FAN] = PINS_RPM;
@@ -19,7 +24,48 @@ static config_t    opts;
 static status_t    status;
 static version_t   version;
 static char        buffer[SERIAL_BUFS];
+static tach_t      tach[NUM_FAN];
+static adc_t       adc;
+static linear_fp_t linear[NUM_FAN];
+static duty_table_t table[NUM_FAN];
+static curve_t     curve;
+static sched_t     sched;
+static hist_t      hist;
+static diag_t      diag;
+static bool        scanning;            // fan detection running
+static uint32_t    scan_end;            // timestamp of scan completion (ms)
+static uint16_t    stream_int = DEF_SINT;
+static uint32_t    stream_next;
+static uint8_t     ee_slot;             // slot of newest settings record
+static uint16_t    ee_seq;              // sequence no. of newest record
+static bool        ee_valid;            // valid record found
+static eeprom_t    ee_shadow;           // record being written
+static volatile uint8_t ee_pos;         // next byte of record to write
+static volatile bool    ee_busy;        // record write in progress
 
+static void tach_isr0() { tach_edge(0); }
+static void tach_isr1() { tach_edge(1); }
+static void tach_isr2() { tach_edge(2); }
+static void tach_isr3() { tach_edge(3); }
+static void (* const tach_isr[NUM_FAN])() = {
+    tach_isr0, tach_isr1, tach_isr2, tach_isr3
+};
+
+
+// bounds of RAM left to the stack, set up by the linker
+extern uint8_t _end;
+extern uint8_t __stack;
+
+/**
+ * @brief Fill RAM left to the stack with `STACK_CANARY`, @see stack_free()
+ *
+ * Runs before any constructors and `main()`, while the stack is still empty.
+ */
+static void __attribute__((naked, used, section(".init3"))) stack_paint()
+{
+    for (uint8_t *p = &_end; p <= &__stack; p++)
+        *p = STACK_CANARY;
+}
 
 void setup()
 {
@@ -64,10 +110,17 @@ void setup()
     memset(version.build, 0, STRL);
     strncpy(version.build, BUILD, STRL-1);
 
-    // scan connected fans
-    fan_scan();
+    // RPM signal edge detection
+    tach_init();
+
+    // temperature sensor sampling
+    adc_init();
+
+    // scan connected fans in background
+    fan_scan_start(millis());
 
     // default configuration
+    opts.period = UPDATE_INT;
     FOREACH_FAN(i) {
         opts.temp_unit = DEF_UNIT;
         opts.fan[i].mode = DEF_MODE;
@@ -77,11 +130,23 @@ void setup()
         opts.fan[i].param.min_duty = DEF_LIN_DL;
         opts.fan[i].param.max_temp = DEF_LIN_TU;
         opts.fan[i].param.max_duty = DEF_LIN_DU;
+        opts.fan[i].points.count = 2;
+        opts.fan[i].points.point[0].temp = DEF_LIN_TL;
+        opts.fan[i].points.point[0].duty = DEF_LIN_DL;
+        opts.fan[i].points.point[1].temp = DEF_LIN_TU;
+        opts.fan[i].points.point[1].duty = DEF_LIN_DU;
+        linear_prepare(&opts.fan[i].param, &linear[i]);
+        points_compile(&opts.fan[i].points, opts.temp_unit, table[i]);
     }
 
     // load configuration from EEPROM
+    opts_scan();
     opts_load();
 
+    // control loop
+    sched_set_period(opts.period);
+    sched_init();
+
     // serial
     Serial.begin(SERIAL_BAUD);
     Serial.setTimeout(SERIAL_TIMO);
@@ -89,116 +154,299 @@ void setup()
 
 void loop()
 {
+    uint32_t start = micros();
+
+    if (sched_poll())
+        control_step();
+
     uint32_t now = millis();
 
-    static uint32_t measure_next = 0;
-    if (now > measure_next) {
-        measure_next = now + UPDATE_INT;
-        FOREACH_TEMP(i)
-            status.temp[i] = get_temp(i);
-        FOREACH_FAN(i) {
-            if (status.fan[i].rpm != NCONN) {
-                status.fan[i].rpm = get_rpm(i);
-                if (opts.fan[i].mode == MODE_LINEAR)
-                    set_duty_linear(i);
-            }
-        }
-    }
+    fan_scan_run(now);
+    curve_run(now);
 
-    if (Serial.available())
+    status.flags = ee_busy ? STATUS_SAVING : 0;
+    stream_run(now);
+
+    if (Serial.available()) {
+        uint32_t serial = micros();
         handle_serial();
+        diag_phase(PHASE_SERIAL, serial);
+    }
+
+    diag_phase(PHASE_LOOP, start);
 }
 
-uint8_t crc8(const uint8_t *data, uint16_t len)
+static uint8_t record_crc(const eeprom_t *e)
 {
-    uint8_t crc = 0x00;
+    return crc8(&e->seq, offsetof(eeprom_t, crc) - offsetof(eeprom_t, seq));
+}
 
-    while (len--) {
-        uint8_t val = *data++;
-        for (uint8_t i=0; i<8; i++) {
-            uint8_t sum = (crc ^ val) & 0x01;
-            crc >>= 1;
-            if (sum)
-                crc ^= 0x8C;
-            val >>= 1;
-        }
-    }
+static bool record_read(uint8_t slot, eeprom_t *e)
+{
+    EEPROM.get(EEPROM_SLOT_OFFS(slot), *e);
 
-    return crc;
+    return e->magic == EEPROM_MAGIC && e->crc == record_crc(e);
+}
+
+void opts_scan()
+{
+    ee_valid = false;
+    FOREACH_U8(slot, EEPROM_SLOTS) {
+        // check magic and sequence no. first, CRC only for newer records
+        uint16_t seq;
+        if (EEPROM[EEPROM_SLOT_OFFS(slot)] != EEPROM_MAGIC)
+            continue;
+        EEPROM.get(EEPROM_SLOT_OFFS(slot) + offsetof(eeprom_t, seq), seq);
+        // wrap-safe comparison
+        if (ee_valid && (int16_t)(seq - ee_seq) <= 0)
+            continue;
+
+        eeprom_t e;
+        if (!record_read(slot, &e))
+            continue;
+        ee_slot = slot;
+        ee_seq = seq;
+        ee_valid = true;
+    }
 }
 
 void opts_save()
 {
-    uint8_t gen = (EEPROM[EEPROM_GOFFS] + 1) % EEPROM_GEN_NUM;
-    EEPROM[EEPROM_GOFFS] = gen;
+    // a write in progress is restarted with the new settings
+    EECR &= ~_BV(EERIE);
+    if (!ee_busy) {
+        ee_slot = ee_valid ? (ee_slot + 1) % EEPROM_SLOTS : 0;
+        ee_seq = ee_valid ? ee_seq + 1 : 0;
+        ee_valid = true;
+    }
 
-    eeprom_t e;
-    e.magic = EEPROM_MAGIC;
-    e.opts = opts;
-    e.crc = crc8((const uint8_t *)&e.opts, sizeof(e.opts));
+    ee_shadow.magic = EEPROM_MAGIC;
+    ee_shadow.seq = ee_seq;
+    ee_shadow.opts = opts;
+    ee_shadow.crc = record_crc(&ee_shadow);
 
-    EEPROM.put(EEPROM_OPT_OFFS(gen), e);
+    ee_pos = 0;
+    ee_busy = true;
+    EECR |= _BV(EERIE);
 }
 
-bool opts_load()
+ISR(EE_READY_vect)
 {
-    uint8_t gen = EEPROM[EEPROM_GOFFS] % EEPROM_GEN_NUM;
+    const uint8_t *data = (const uint8_t *)&ee_shadow;
 
-    eeprom_t e;
-    EEPROM.get(EEPROM_OPT_OFFS(gen), e);
+    // one byte per interrupt, skipping bytes that are unchanged
+    while (ee_pos < sizeof(eeprom_t)) {
+        EEAR = EEPROM_SLOT_OFFS(ee_slot) + ee_pos;
+        EECR |= _BV(EERE);
+        uint8_t value = data[ee_pos++];
+        if (EEDR != value) {
+            EEDR = value;
+            EECR |= _BV(EEMPE);
+            EECR |= _BV(EEPE);
+            return;
+        }
+    }
 
-    if (e.magic != EEPROM_MAGIC)
-        return false;
-    uint8_t crc = crc8((const uint8_t *)&e.opts, sizeof(e.opts));
-    if (crc != e.crc)
+    EECR &= ~_BV(EERIE);
+    ee_busy = false;
+}
+
+bool opts_load()
+{
+    // record still being written is taken from its shadow
+    eeprom_t e = ee_shadow;
+    if (!ee_busy && (!ee_valid || !record_read(ee_slot, &e)))
         return false;
 
+    uint16_t period = opts.period;
+    FOREACH_FAN(i) {
+        if (!points_valid(&e.opts.fan[i].points))
+            e.opts.fan[i].points = opts.fan[i].points;
+    }
     opts = e.opts;
-    FOREACH_FAN(i)
-        if (opts.fan[i].mode == MODE_MANUAL)
-            set_duty(i, opts.fan[i].duty);
+    if (!sched_set_period(opts.period))
+        sched_set_period(period);
+    FOREACH_FAN(i) {
+        linear_prepare(&opts.fan[i].param, &linear[i]);
+        points_compile(&opts.fan[i].points, opts.temp_unit, table[i]);
+        fan_apply(i);
+    }
 
     return true;
 }
 
-uint16_t get_rpm(uint8_t fan)
+void tach_init()
 {
-    uint16_t rpm = 0;
+    FOREACH_FAN(i) {
+        uint8_t pin = pins_rpm[i];
 
-    FOREACH_U8(i, RPM_SNUM) {
-        uint32_t time;
-        FOREACH_U8(n, RPM_RETRIES) {
-            time = pulseIn(pins_rpm[fan], LOW, RPM_TIMEOUT);
-            if (time >= RPM_TMIN || status.fan[fan].duty == 0)
-                break;
+        tach[i].port = portInputRegister(digitalPinToPort(pin));
+        tach[i].mask = digitalPinToBitMask(pin);
+        tach[i].level = *tach[i].port & tach[i].mask;
+
+        if (digitalPinToInterrupt(pin) != NOT_AN_INTERRUPT) {
+            tach[i].mode = TACH_INT;
+            attachInterrupt(digitalPinToInterrupt(pin), tach_isr[i], FALLING);
+        } else if (digitalPinToPCICR(pin)) {
+            tach[i].mode = TACH_PCINT;
+            *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+            *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+        } else {
+            tach[i].mode = TACH_POLL;
         }
-        if (time >= RPM_TMIN)
-            rpm += 15000000UL / time;
     }
+}
 
-    return rpm / RPM_SNUM;
+static inline void tach_change(uint8_t fan)
+{
+    uint8_t level = *tach[fan].port & tach[fan].mask;
+    if (level == tach[fan].level)
+        return;
+
+    tach[fan].level = level;
+    if (!level)
+        tach_edge(fan);
 }
 
-uint16_t get_temp(uint8_t sensor)
+ISR(PCINT0_vect)
+{
+    FOREACH_FAN(i)
+        if (tach[i].mode == TACH_PCINT)
+            tach_change(i);
+}
+
+void tach_poll()
+{
+    FOREACH_FAN(i)
+        if (tach[i].mode == TACH_POLL)
+            tach_change(i);
+}
+
+void tach_edge(uint8_t fan)
 {
-    // Steinhart–Hart coefficients
-    static const float a = 1.009249522e-03;
-    static const float b = 2.378405444e-04;
-    static const float c = 2.019202697e-07;
+    uint32_t now = micros();
+    uint32_t period = now - tach[fan].last;
+
+    if (period < RPM_TMIN)
+        return;
+    tach[fan].last = now;
+    if (period > RPM_TIMEOUT)
+        return;
+
+    tach[fan].sum += period;
+    tach[fan].count++;
+}
+
+uint16_t get_rpm(uint8_t fan)
+{
+    uint32_t sum;
+    uint16_t count;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sum = tach[fan].sum;
+        count = tach[fan].count;
+        tach[fan].sum = 0;
+        tach[fan].count = 0;
+    }
+
+    if (!count)
+        return 0;
+
+    // two pulses per revolution
+    return 30000000UL / (sum / count);
+}
+
+static void adc_select(uint8_t sensor)
+{
+    uint8_t chan = adc.chan[sensor];
+
+    // AVcc reference, channels 8 and up need MUX5
+    ADMUX = _BV(REFS0) | (chan & 0x07);
+    ADCSRB = (chan & 0x08) ? _BV(MUX5) : 0;
+}
+
+void adc_init()
+{
+    FOREACH_TEMP(i) {
+        uint8_t chan = analogPinToChannel(pins_tmp[i] - A0);
+        adc.chan[i] = chan;
+
+        // digital input buffers only add noise
+        if (chan < 8)
+            DIDR0 |= _BV(chan);
+        else
+            DIDR2 |= _BV(chan - 8);
+    }
 
-    int v0 = analogRead(pins_tmp[sensor]);
-    if (!v0)
+    adc.sensor = 0;
+    adc.skip = ADC_SETTLE;
+    adc_select(0);
+
+    // free-running mode (ADTS = 0), ADC clock 16 MHz / 128 = 125 kHz
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) |
+             _BV(ADPS1) | _BV(ADPS0);
+}
+
+ISR(ADC_vect)
+{
+    uint16_t value = ADC;
+
+    // the conversion following a channel switch was already started on the
+    // old channel, the next one may not be settled yet
+    if (adc.skip) {
+        adc.skip--;
+        return;
+    }
+
+    adc.sum += value;
+    if (++adc.count < _BV(ADC_OVERSMP))
+        return;
+
+    uint8_t s = adc.sensor;
+    if (adc.primed & _BV(s)) {
+        adc.acc[s] += adc.sum - (adc.acc[s] >> ADC_FILTER);
+    } else {
+        adc.acc[s] = (uint32_t)adc.sum << ADC_FILTER;
+        adc.primed |= _BV(s);
+    }
+    adc.sum = 0;
+    adc.count = 0;
+
+    if (++s == NUM_TEMP)
+        s = 0;
+    if (s != adc.sensor) {
+        adc.sensor = s;
+        adc_select(s);
+        adc.skip = ADC_SETTLE;
+    }
+}
+
+uint16_t adc_read(uint8_t sensor)
+{
+    uint32_t acc;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        acc = adc.acc[sensor];
+    }
+
+    return acc >> ADC_FILTER;
+}
+
+uint16_t get_temp(uint8_t sensor)
+{
+    uint16_t v0 = adc_read(sensor);
+    if (v0 < _BV(ADC_OVERSMP))
         return NCONN;
 
-    float r2 = TMP_R * (1023.0 / (float)v0 - 1.0);
-    float log_r2 = log(r2);
-    float t = 1.0 / (a + b*log_r2 + c*log_r2*log_r2*log_r2);
+    const uint16_t *lut = opts.temp_unit == DEG_F ? tmp_lut_f : tmp_lut_c;
+    const uint8_t shift = TMP_LUT_SHIFT + ADC_OVERSMP;
+    uint8_t i = v0 >> shift;
+    uint8_t frac = v0 & (_BV(shift) - 1);
 
-    double temp = t - 273.15;
-    if (opts.temp_unit == DEG_F)
-        temp = t * 1.8 + 32.0;
+    // tables are monotonically increasing
+    uint16_t t0 = pgm_read_word(&lut[i]);
+    uint16_t t1 = pgm_read_word(&lut[i+1]);
 
-    return (uint16_t)(temp * 100.0);
+    return t0 + (((uint32_t)(t1 - t0) * frac) >> shift);
 }
 
 void set_duty(uint8_t fan, uint8_t value)
@@ -220,49 +468,388 @@ void set_duty(uint8_t fan, uint8_t value)
 
 void set_duty_linear(uint8_t fan)
 {
-    double temp = status.temp[opts.fan[fan].sensor];
-    double t_min = (double)opts.fan[fan].param.min_temp;
-    double t_max = (double)opts.fan[fan].param.max_temp;
+    uint8_t duty = linear_duty(&opts.fan[fan].param, &linear[fan],
+                               status.temp[opts.fan[fan].sensor]);
 
-    uint8_t duty;
-    if (temp <= t_min)
-        duty = opts.fan[fan].param.min_duty;
-    else if (temp >= t_max)
-        duty = opts.fan[fan].param.max_duty;
-    else
-        duty = opts.fan[fan].param.min_duty + (temp - t_min) *
-            (opts.fan[fan].param.max_duty - opts.fan[fan].param.min_duty) /
-            (t_max - t_min);
+    if (status.fan[fan].duty != duty)
+        set_duty(fan, duty);
+}
+
+void set_duty_points(uint8_t fan)
+{
+    uint8_t duty = table_duty(table[fan], opts.temp_unit,
+                              status.temp[opts.fan[fan].sensor]);
 
     if (status.fan[fan].duty != duty)
         set_duty(fan, duty);
 }
 
-void fan_scan()
+void fan_scan_start(uint32_t now)
 {
-    FOREACH_FAN(i)
+    FOREACH_FAN(i) {
         set_duty(i, SCAN_DUTY);
+        status.fan[i].rpm = NSCAN;
+    }
 
-    delay(SCAN_SETTLE);
+    scanning = true;
+    scan_end = now + SCAN_SETTLE;
+}
+
+void fan_scan_run(uint32_t now)
+{
+    if (!scanning || (int32_t)(now - scan_end) < 0)
+        return;
+    scanning = false;
 
     FOREACH_FAN(i) {
-        FOREACH_U8(n, SCAN_TRIES) {
-            status.fan[i].rpm = get_rpm(i);
-            if (status.fan[i].rpm > 0)
-                break;
-        }
+        status.fan[i].rpm = get_rpm(i);
         if (status.fan[i].rpm == 0)
             status.fan[i].rpm = NCONN;
-        set_duty(i, DEF_DUTY);
+        fan_apply(i);
+    }
+}
+
+void control_step()
+{
+    uint32_t start = micros();
+
+    FOREACH_TEMP(i)
+        status.temp[i] = get_temp(i);
+
+    // fan detection and curve generation take over RPM measurement and duty
+    // control
+    bool control = !scanning && curve.state != CURVE_RUNNING;
+    if (control) {
+        FOREACH_FAN(i)
+            if (status.fan[i].rpm != NCONN)
+                status.fan[i].rpm = get_rpm(i);
+    }
+
+    diag_phase(PHASE_MEASURE, start);
+    start = micros();
+
+    if (control) {
+        FOREACH_FAN(i) {
+            if (status.fan[i].rpm == NCONN)
+                continue;
+            if (opts.fan[i].mode == MODE_LINEAR)
+                set_duty_linear(i);
+            else if (opts.fan[i].mode == MODE_POINTS)
+                set_duty_points(i);
+        }
+    }
+
+    hist_push(&hist, &status);
+
+    diag_phase(PHASE_CONTROL, start);
+}
+
+void sched_init()
+{
+    OCR0B = 0x80;
+    TIMSK0 |= _BV(OCIE0B);
+}
+
+static void sched_reset()
+{
+    memset(&sched.stats, 0, sizeof(sched.stats));
+    sched.stats.jitter_min = INT16_MAX;
+    sched.stats.jitter_max = INT16_MIN;
+    sched.delay_sum = 0;
+}
+
+bool sched_set_period(uint16_t period)
+{
+    if (period < PERIOD_MIN || period > PERIOD_MAX)
+        return false;
+
+    opts.period = period;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sched.period = (uint32_t)period * 1000;
+        sched.elapsed = 0;
+        sched_reset();
     }
+
+    return true;
+}
+
+ISR(TIMER0_COMPB_vect)
+{
+    // loop() may block in serial reads for up to SERIAL_TIMO
+    tach_poll();
+
+    sched.elapsed += SCHED_TICK;
+    if (sched.elapsed < sched.period)
+        return;
+    sched.elapsed -= sched.period;
+
+    if (sched.due)
+        sched.stats.overruns++;
+    sched.tick = micros();
+    sched.due = true;
+}
+
+bool sched_poll()
+{
+    uint32_t tick;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!sched.due)
+            return false;
+        sched.due = false;
+        tick = sched.tick;
+    }
+
+    uint32_t now = micros();
+    uint32_t delay = now - tick;
+    sched.delay_sum += delay;
+    if (delay > sched.stats.delay_max)
+        sched.stats.delay_max = MIN(delay, UINT16_MAX);
+
+    // jitter needs the previous cycle within the same statistics
+    if (sched.stats.cycles) {
+        int32_t jitter = (int32_t)(now - sched.last) - (int32_t)sched.period;
+        jitter = constrain(jitter, INT16_MIN, INT16_MAX);
+        if (jitter < sched.stats.jitter_min)
+            sched.stats.jitter_min = jitter;
+        if (jitter > sched.stats.jitter_max)
+            sched.stats.jitter_max = jitter;
+    }
+    sched.last = now;
+    if (sched.stats.cycles < UINT16_MAX)
+        sched.stats.cycles++;
+
+    return true;
+}
+
+void sched_stats(msg_timing_t *stats)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *stats = sched.stats;
+        stats->period = sched.period / 1000;
+        stats->delay_avg = stats->cycles ? sched.delay_sum / stats->cycles : 0;
+        if (stats->cycles < 2) {
+            stats->jitter_min = 0;
+            stats->jitter_max = 0;
+        }
+        sched_reset();
+    }
+}
+
+void diag_phase(uint8_t phase, uint32_t start)
+{
+    uint16_t duration = MIN(micros() - start, (uint32_t)UINT16_MAX);
+    phase_acc_t *acc = &diag.phase[phase];
+
+    // sum cannot overflow with 16-bit durations and count
+    if (acc->n == UINT16_MAX) {
+        acc->sum >>= 1;
+        acc->n >>= 1;
+    }
+    acc->sum += duration;
+    acc->n++;
+    if (acc->count < UINT32_MAX)
+        acc->count++;
+    if (duration > acc->max)
+        acc->max = duration;
+}
+
+uint16_t stack_free()
+{
+    const uint8_t *p = &_end;
+    while (p <= &__stack && *p == STACK_CANARY)
+        p++;
+
+    return p - &_end;
+}
+
+void diag_stats(msg_diag_t *stats)
+{
+    stats->uptime = millis();
+    stats->stack_free = stack_free();
+    stats->stack_size = &__stack - &_end + 1;
+    stats->dropped = diag.dropped;
+    stats->errors = diag.errors;
+    FOREACH_U8(i, NUM_PHASE) {
+        const phase_acc_t *acc = &diag.phase[i];
+        stats->phase[i].count = acc->count;
+        stats->phase[i].avg = acc->n ? acc->sum / acc->n : 0;
+        stats->phase[i].max = acc->max;
+    }
+
+    memset(&diag, 0, sizeof(diag));
 }
 
 void reset()
 {
+    // finish pending EEPROM write first
+    while (ee_busy) {};
+
     wdt_enable(50);
     while (true) {};
 }
 
+uint8_t apply_command(uint8_t command, const char *data)
+{
+    switch ((cmd_t)command) {
+        case CMD_FAN_MODE:
+        {
+            const msg_fan_mode_t *msg = (const msg_fan_mode_t *)data;
+            if (msg->fan < NUM_FAN && (msg->mode == MODE_MANUAL ||
+                                       msg->mode == MODE_LINEAR ||
+                                       msg->mode == MODE_POINTS)) {
+                opts.fan[msg->fan].mode = msg->mode;
+                fan_apply(msg->fan);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_FAN_DUTY:
+        {
+            const msg_fan_duty_t *msg = (const msg_fan_duty_t *)data;
+            if (msg->fan < NUM_FAN && msg->duty <= 100) {
+                opts.fan[msg->fan].mode = MODE_MANUAL;
+                opts.fan[msg->fan].duty = msg->duty;
+                fan_apply(msg->fan);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_FAN_MAP:
+        {
+            const msg_fan_map_t *msg = (const msg_fan_map_t *)data;
+            if (msg->fan < NUM_FAN && msg->sensor < NUM_TEMP) {
+                opts.fan[msg->fan].sensor = msg->sensor;
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_LINEAR:
+        {
+            const msg_fan_linear_t *msg = (const msg_fan_linear_t *)data;
+            if (msg->fan < NUM_FAN && msg->param.min_duty <= 100 &&
+                                      msg->param.max_duty <= 100) {
+                opts.fan[msg->fan].param = msg->param;
+                linear_prepare(&opts.fan[msg->fan].param, &linear[msg->fan]);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_POINTS:
+        {
+            const msg_fan_points_t *msg = (const msg_fan_points_t *)data;
+            if (msg->fan < NUM_FAN && points_valid(&msg->points)) {
+                opts.fan[msg->fan].points = msg->points;
+                points_compile(&msg->points, opts.temp_unit, table[msg->fan]);
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_SUBSCRIBE:
+        {
+            const msg_subscribe_t *msg = (const msg_subscribe_t *)data;
+            if (msg->interval == 0 || msg->interval >= SINT_MIN) {
+                stream_int = msg->interval;
+                stream_next = millis() + stream_int;
+                return RESULT_OK;
+            }
+            break;
+        }
+        case CMD_PERIOD:
+        {
+            const msg_period_t *msg = (const msg_period_t *)data;
+            if (sched_set_period(msg->period))
+                return RESULT_OK;
+            break;
+        }
+        case CMD_SAVE:
+        {
+            // the record itself is written in the background
+            uint32_t start = micros();
+            opts_save();
+            diag_phase(PHASE_EEPROM, start);
+            return RESULT_OK;
+        }
+        case CMD_LOAD:
+        {
+            uint32_t start = micros();
+            bool loaded = opts_load();
+            diag_phase(PHASE_EEPROM, start);
+            return loaded ? RESULT_OK : RESULT_ERR;
+        }
+        default:
+            break;
+    }
+
+    return RESULT_ERR;
+}
+
+uint8_t apply_batch(char *data)
+{
+    msg_batch_t batch = *(msg_batch_t *)data;
+    const char *entry = data + sizeof(msg_batch_t);
+    const char *end = entry + batch.len;
+
+    // results never overtake the entries still to be executed, as each entry
+    // takes at least one byte more
+    for (uint8_t i=0; i<batch.count; i++) {
+        uint8_t result = RESULT_ERR;
+        if (entry < end) {
+            uint8_t command = *entry++;
+            int8_t len = command == CMD_BATCH ? -1 : request_len(command);
+            if (len < 0 || entry + len > end) {
+                entry = end;
+            } else {
+                result = apply_command(command, entry);
+                entry += len;
+            }
+        }
+        data[i] = result;
+    }
+
+    return batch.count;
+}
+
+void send_frame(uint8_t seq, uint8_t command, const void *data, uint8_t len)
+{
+    header_t header = { SOF, seq, command, len };
+    uint8_t crc = crc8_update(crc8(&header, sizeof(header)), data, len);
+
+    Serial.write((const uint8_t *)&header, sizeof(header));
+    if (len)
+        Serial.write((const uint8_t *)data, len);
+    Serial.write(crc);
+}
+
+void hist_send(uint8_t seq, uint16_t from)
+{
+    msg_history_t msg;
+    uint16_t pos;
+    uint8_t len = hist_chunk(&hist, from, &msg, &pos);
+    msg.period = opts.period;
+
+    // records may wrap around the end of the ring buffer
+    uint8_t first = MIN(len, HIST_LEN - pos);
+
+    header_t header = { SOF, seq, CMD_HISTORY, (uint8_t)(sizeof(msg) + len) };
+    uint8_t crc = crc8_update(crc8(&header, sizeof(header)), &msg, sizeof(msg));
+    crc = crc8_update(crc, &hist.data[pos], first);
+    crc = crc8_update(crc, hist.data, len - first);
+
+    Serial.write((const uint8_t *)&header, sizeof(header));
+    Serial.write((const uint8_t *)&msg, sizeof(msg));
+    Serial.write(&hist.data[pos], first);
+    if (len > first)
+        Serial.write(hist.data, len - first);
+    Serial.write(crc);
+}
+
+static void send_error(uint8_t seq, uint8_t command)
+{
+    if (diag.errors < UINT16_MAX)
+        diag.errors++;
+    send_frame(seq, command, NULL, 0);
+}
+
 void handle_serial()
 {
     bool sof = false;
@@ -274,17 +861,53 @@ void handle_serial()
             sof = true;
             break;
         }
+        if (diag.dropped < UINT16_MAX)
+            diag.dropped++;
     }
     if (!sof)
         return;
 
-    int command = Serial.read();
-    if (command == -1)
+    header_t header = { SOF, 0, 0, 0 };
+    if (Serial.readBytes((char *)&header.seq, sizeof(header) - 1) !=
+            sizeof(header) - 1)
         return;
 
+    // no request is that long, skip payload to stay in sync
+    if (header.len > SERIAL_BUFS) {
+        for (uint16_t left = header.len + 1; left > 0; ) {
+            size_t n = Serial.readBytes(buffer, MIN(left, SERIAL_BUFS));
+            if (n == 0)
+                break;
+            left -= n;
+        }
+        send_error(header.seq, CMD_INVALID);
+        return;
+    }
+
+    // receive payload and verify checksum before acting on anything
+    uint8_t crc;
+    if (Serial.readBytes(buffer, header.len) != header.len ||
+            Serial.readBytes((char *)&crc, 1) != 1 ||
+            crc != crc8_update(crc8(&header, sizeof(header)), buffer,
+                               header.len)) {
+        send_error(header.seq, CMD_CHECKSUM);
+        return;
+    }
+
+    // batch entries follow the batch header
+    int8_t len = request_len(header.cmd);
+    if (header.cmd == CMD_BATCH && header.len >= len) {
+        msg_batch_t *batch = (msg_batch_t *)buffer;
+        len = batch->count > BATCH_LEN ? -1 : len + batch->len;
+    }
+    if (len < 0 || header.len != len) {
+        send_error(header.seq, CMD_INVALID);
+        return;
+    }
+
     size_t reply_len = 0;
     char *reply = buffer;
-    switch ((cmd_t)command) {
+    switch ((cmd_t)header.cmd) {
         case CMD_VERSION:
             reply_len = sizeof(version_t);
             reply = (char *)&version;
@@ -298,126 +921,157 @@ void handle_serial()
             reply = (char *)&opts;
             break;
         case CMD_FAN_MODE:
-        {
-            reply_len = 1;
-            buffer[0] = RESULT_ERR;
-            if (Serial.readBytes(buffer, sizeof(msg_fan_mode_t)) ==
-                    sizeof(msg_fan_mode_t)) {
-                msg_fan_mode_t *msg = (msg_fan_mode_t *)buffer;
-                if (msg->fan < NUM_FAN && (msg->mode == MODE_MANUAL ||
-                                           msg->mode == MODE_LINEAR)) {
-                    opts.fan[msg->fan].mode = msg->mode;
-                    if (msg->mode == MODE_MANUAL)
-                        set_duty(msg->fan, opts.fan[msg->fan].duty);
-                    else if (msg->mode == MODE_LINEAR)
-                        set_duty_linear(msg->fan);
-                    buffer[0] = RESULT_OK;
-                }
-            }
-            break;
-        }
         case CMD_FAN_DUTY:
-        {
+        case CMD_FAN_MAP:
+        case CMD_LINEAR:
+        case CMD_POINTS:
+        case CMD_SUBSCRIBE:
+        case CMD_PERIOD:
+        case CMD_SAVE:
+        case CMD_LOAD:
             reply_len = 1;
-            buffer[0] = RESULT_ERR;
-            if (Serial.readBytes(buffer, sizeof(msg_fan_duty_t)) ==
-                    sizeof(msg_fan_duty_t)) {
-                msg_fan_duty_t *msg = (msg_fan_duty_t *)buffer;
-                if (msg->fan < NUM_FAN && msg->duty <= 100) {
-                    opts.fan[msg->fan].mode = MODE_MANUAL;
-                    opts.fan[msg->fan].duty = msg->duty;
-                    set_duty(msg->fan, msg->duty);
-                    buffer[0] = RESULT_OK;
-                }
-            }
+            buffer[0] = apply_command(header.cmd, buffer);
             break;
-        }
-        case CMD_FAN_MAP:
-        {
+        case CMD_HISTORY:
+            hist_send(header.seq, ((msg_history_req_t *)buffer)->seq);
+            return;
+        case CMD_TIMING:
+            sched_stats((msg_timing_t *)buffer);
+            reply_len = sizeof(msg_timing_t);
+            break;
+        case CMD_DIAG:
+            diag_stats((msg_diag_t *)buffer);
+            reply_len = sizeof(msg_diag_t);
+            break;
+        case CMD_BATCH:
+            reply_len = apply_batch(buffer);
+            break;
+        case CMD_FAN_CURVE:
             reply_len = 1;
-            buffer[0] = RESULT_ERR;
-            if (Serial.readBytes(buffer, sizeof(msg_fan_map_t)) ==
-                    sizeof(msg_fan_map_t)) {
-                msg_fan_map_t *msg = (msg_fan_map_t *)buffer;
-                if (msg->fan < NUM_FAN && msg->sensor < NUM_TEMP) {
-                    buffer[0] = RESULT_OK;
-                    opts.fan[msg->fan].sensor = msg->sensor;
-                }
-            }
+            buffer[0] = curve_start() ? RESULT_OK : RESULT_ERR;
             break;
-        }
-        case CMD_LINEAR:
+        case CMD_CURVE_STATE:
         {
-            reply_len = 1;
-            buffer[0] = RESULT_ERR;
-            if (Serial.readBytes(buffer, sizeof(msg_fan_linear_t)) ==
-                    sizeof(msg_fan_linear_t)) {
-                msg_fan_linear_t *msg = (msg_fan_linear_t *)buffer;
-                if ( msg->fan < NUM_FAN && msg->param.min_duty <= 100 &&
-                                           msg->param.max_duty <= 100) {
-                    opts.fan[msg->fan].param = msg->param;
-                    buffer[0] = RESULT_OK;
-                }
-            }
+            msg_curve_state_t *msg = (msg_curve_state_t *)buffer;
+            msg->state = curve.state;
+            msg->step = curve.step;
+            msg->steps = 100/CURVE_STEP + 1;
+            reply_len = sizeof(msg_curve_state_t);
             break;
         }
-        case CMD_FAN_CURVE:
+        case CMD_CURVE_DATA:
             reply_len = sizeof(msg_fan_curve_t);
-            fan_curve();
+            reply = (char *)&curve.data;
             break;
-        case CMD_SAVE:
-            reply_len = 1;
-            buffer[0] = RESULT_OK;
-            opts_save();
-            break;
-        case CMD_LOAD:
+        case CMD_CURVE_STOP:
             reply_len = 1;
-            buffer[0] = opts_load() ? RESULT_OK : RESULT_ERR;
+            buffer[0] = RESULT_ERR;
+            if (curve.state == CURVE_RUNNING) {
+                curve_stop(CURVE_CANCELLED);
+                buffer[0] = RESULT_OK;
+            }
             break;
         case CMD_RESET:
             reset();
             break;
         default:
-            Serial.write(SOF);
-            Serial.write(CMD_INVALID);
+            send_error(header.seq, CMD_INVALID);
             return;
     }
 
-    Serial.write(SOF);
-    Serial.write((uint8_t)command);
-    Serial.write(reply, reply_len);
+    send_frame(header.seq, header.cmd, reply, reply_len);
 }
 
-void fan_curve()
+void stream_run(uint32_t now)
 {
-    msg_fan_curve_t *data = (msg_fan_curve_t *)buffer;
-    uint16_t rpm[NUM_FAN][CURVE_SMPNUM];
+    if (!stream_int || (int32_t)(now - stream_next) < 0)
+        return;
+    stream_next = now + stream_int;
 
-    for (int i=0; i<=100/CURVE_STEP; i++) {
-        uint8_t duty = 100 - i * CURVE_STEP;
-        FOREACH_FAN(f)
-            set_duty(f, duty);
-        data->points[i].duty = duty;
+    // host has closed the port, end subscription (`!Serial` delays 10 ms)
+    if (!Serial.dtr()) {
+        stream_int = 0;
+        return;
+    }
 
-        delay(CURVE_SDELAY);
+    send_frame(0, CMD_STATUS_EVENT, &status, sizeof(status));
+}
 
-        FOREACH_U8(n, CURVE_SMPNUM) {
-            FOREACH_FAN(f)
-                rpm[f][n] = get_rpm(f);
-            delay(CURVE_SMPDEL);
-        }
+void fan_apply(uint8_t fan)
+{
+    if (scanning || curve.state == CURVE_RUNNING)
+        return;
 
-        FOREACH_FAN(f) {
-            for (int n=1; n<CURVE_SMPNUM; n++)
-                rpm[f][0] += rpm[f][n];
-            data->points[i].rpm[f] = rpm[f][0] / CURVE_SMPNUM;
-        }
+    if (opts.fan[fan].mode == MODE_MANUAL)
+        set_duty(fan, opts.fan[fan].duty);
+    else if (opts.fan[fan].mode == MODE_LINEAR)
+        set_duty_linear(fan);
+    else if (opts.fan[fan].mode == MODE_POINTS)
+        set_duty_points(fan);
+}
+
+static void curve_step(uint32_t now)
+{
+    uint8_t duty = 100 - curve.step * CURVE_STEP;
+    FOREACH_FAN(f) {
+        set_duty(f, duty);
+        curve.rpm[f] = 0;
+    }
+    curve.data.points[curve.step].duty = duty;
+
+    curve.sample = 0;
+    curve.next = now + CURVE_SDELAY;
+}
+
+bool curve_start()
+{
+    if (scanning || curve.state == CURVE_RUNNING)
+        return false;
+
+    memset(&curve.data, 0, sizeof(curve.data));
+    curve.state = CURVE_RUNNING;
+    curve.step = 0;
+    curve_step(millis());
+
+    return true;
+}
+
+void curve_run(uint32_t now)
+{
+    if (curve.state != CURVE_RUNNING || (int32_t)(now - curve.next) < 0)
+        return;
+
+    // first read-out covers settling only and is discarded
+    FOREACH_FAN(f) {
+        uint16_t rpm = get_rpm(f);
+        if (curve.sample == 0)
+            continue;
+        curve.rpm[f] += rpm;
+        if (status.fan[f].rpm != NCONN)
+            status.fan[f].rpm = rpm;
     }
 
-    // restore manual duty
+    if (curve.sample < CURVE_SMPNUM) {
+        curve.sample++;
+        curve.next = now + CURVE_SMPDEL;
+        return;
+    }
+
+    FOREACH_FAN(f)
+        curve.data.points[curve.step].rpm[f] = curve.rpm[f] / CURVE_SMPNUM;
+
+    if (++curve.step > 100/CURVE_STEP)
+        curve_stop(CURVE_DONE);
+    else
+        curve_step(now);
+}
+
+void curve_stop(uint8_t state)
+{
+    curve.state = state;
+
     FOREACH_FAN(i)
-        if (opts.fan[i].mode == MODE_MANUAL)
-            set_duty(i, opts.fan[i].duty);
+        fan_apply(i);
 }
 
 /* vim: set ts=4 sw=4 et */
@@ -11,9 +11,44 @@
 
 #include "config.h"
 
+/**
+ * @file
+ * @brief Serial protocol definitions
+ *
+ * Each message (request and reply) is framed as follows:
+ *
+ *   header_t  header   start-of-frame delimiter, sequence no., command byte
+ *                      and payload length
+ *   uint8_t   payload  command specific payload (msg_*_t), may be empty
+ *   uint8_t   crc      CRC8 covering header and payload, @see crc8.h
+ *
+ * Frames failing the check are answered with `CMD_CHECKSUM`, unknown commands
+ * or unexpected payload lengths with `CMD_INVALID` (both without payload).
+ *
+ * Replies carry the sequence no. of their request, so the host may send
+ * several requests without waiting and match the replies by sequence no.
+ * Sequence no. 0 is reserved for frames sent by the device on its own.
+ *
+ * `CMD_BATCH` carries several setting commands in one frame, @see msg_batch_t.
+ *
+ * `CMD_POINTS` sets the curve of `MODE_POINTS`, which the device compiles into
+ * a duty table, @see control.h.
+ *
+ * `CMD_HISTORY` fetches readings of past control cycles in chunks, each
+ * holding delta-encoded records, @see history.h.
+ *
+ * `CMD_TIMING` reports how precisely the control loop keeps its period, which
+ * is set by `CMD_PERIOD`. `CMD_DIAG` reports where the firmware spends its
+ * time and how much stack it has left.
+ *
+ * After `CMD_SUBSCRIBE` the device additionally sends `CMD_STATUS_EVENT` frames
+ * carrying `msg_status_t` on its own, which may precede any reply.
+ */
+
 
 #define SOF    0x42    // Start-of-Frame delimiter byte value
 #define NCONN  0xffff  // Disconnected RPM/temp value
+#define NSCAN  0xfffe  // RPM value while fan detection is running
 #define STRL   32      // Length for fixed strings
 
 #pragma pack(push, 1)
@@ -28,10 +63,22 @@ typedef enum {
     CMD_FAN_MODE   = 0x03,  //< set fan mode
     CMD_FAN_DUTY   = 0x04,  //< set fan duty (implies `MODE_MANUAL`)
     CMD_FAN_MAP    = 0x05,  //< set fan<->sensor mapping
-    CMD_FAN_CURVE  = 0x06,  //< generate fan curves
+    CMD_FAN_CURVE  = 0x06,  //< start fan curve generation
     CMD_LINEAR     = 0x07,  //< set linear fan control parameters
     CMD_SAVE       = 0x08,  //< save settings to EEPROM
     CMD_LOAD       = 0x09,  //< load settings from EEPROM
+    CMD_CURVE_STATE = 0x0a, //< get fan curve generation progress
+    CMD_CURVE_DATA = 0x0b,  //< get generated fan curves
+    CMD_CURVE_STOP = 0x0c,  //< cancel fan curve generation
+    CMD_SUBSCRIBE  = 0x0d,  //< set periodic status interval
+    CMD_STATUS_EVENT = 0x0e, //< periodic status (sent by device only)
+    CMD_BATCH      = 0x0f,  //< apply several setting commands at once
+    CMD_TIMING     = 0x10,  //< get control loop timing statistics
+    CMD_PERIOD     = 0x11,  //< set control period
+    CMD_POINTS     = 0x12,  //< set multi-point fan control curve
+    CMD_HISTORY    = 0x13,  //< get readings of past control cycles
+    CMD_DIAG       = 0x14,  //< get firmware self-diagnostics
+    CMD_CHECKSUM   = 0xfd,  //< corrupt request frame (reply only)
     CMD_INVALID    = 0xfe,  //< invalid command
     CMD_RESET      = 0xff   //< reset device
 } cmd_t;
@@ -44,14 +91,33 @@ typedef enum {
     RESULT_ERR = 0xff    //< Failure
 } result_t;
 
+/**
+ * @brief Status flags
+ */
+typedef enum {
+    STATUS_SAVING = 0x01    //< settings still being written to EEPROM
+} status_flag_t;
+
 /**
  * @brief Fan operation mode
  */
 typedef enum {
     MODE_MANUAL  = 0x00,    //< manual duty
-    MODE_LINEAR  = 0x01     //< linear curve between two points
+    MODE_LINEAR  = 0x01,    //< linear curve between two points
+    MODE_POINTS  = 0x02     //< piecewise linear curve through up to
+                            //  `NUM_POINTS` points
 } fan_mode_t;
 
+/**
+ * @brief Fan curve generation state
+ */
+typedef enum {
+    CURVE_IDLE      = 0x00, //< not started yet
+    CURVE_RUNNING   = 0x01, //< in progress
+    CURVE_DONE      = 0x02, //< finished, fan curves available
+    CURVE_CANCELLED = 0x03  //< cancelled, fan curves incomplete
+} curve_state_t;
+
 /**
  * @brief Temperature unit
  */
@@ -60,12 +126,27 @@ typedef enum {
     DEG_F = 0x01            //< degrees Fahrenheit
 } temp_unit_t;
 
+/**
+ * @brief Firmware phase timed for diagnostics, @see msg_diag_t
+ */
+typedef enum {
+    PHASE_LOOP    = 0x00,   //< whole `loop()` iteration
+    PHASE_MEASURE = 0x01,   //< reading sensors and fan RPMs
+    PHASE_CONTROL = 0x02,   //< updating duties and history
+    PHASE_SERIAL  = 0x03,   //< receiving and handling a request
+    PHASE_EEPROM  = 0x04    //< saving/loading settings
+} phase_t;
+
+#define NUM_PHASE  5       // No. of phases timed
+
 /**
  * @brief Serial message header
  */
 typedef struct {
     uint8_t  sof;           //< start-of-frame delimiter
+    uint8_t  seq;           //< sequence no., echoed in reply
     uint8_t  cmd;           //< command byte (@see cmd_t)
+    uint8_t  len;           //< payload length in bytes
 } header_t;
 
 /**
@@ -78,6 +159,25 @@ typedef struct {
     uint8_t  max_duty;      //< high duty
 } linear_t;
 
+/**
+ * @brief Point of multi-point fan control curve
+ */
+typedef struct {
+    uint16_t temp;          //< temperature (*100 deg)
+    uint8_t  duty;          //< duty
+} point_t;
+
+/**
+ * @brief Multi-point fan control curve
+ *
+ * Points are sorted by strictly increasing temperature. Below the first and
+ * above the last point, the duty of that point applies.
+ */
+typedef struct {
+    uint8_t  count;                 //< no. of points used (1-`NUM_POINTS`)
+    point_t  point[NUM_POINTS];     //< curve points
+} points_t;
+
 /**
  * @brief Fan status dataset
  */
@@ -92,6 +192,7 @@ typedef struct {
 typedef struct {
     fan_status_t  fan[NUM_FAN];     //< fan status
     uint16_t      temp[NUM_TEMP];   //< temperatures (*100 deg)
+    uint8_t       flags;            //< status flags (@see status_flag_t)
 } status_t;
 
 /**
@@ -100,8 +201,9 @@ typedef struct {
 typedef struct {
     uint8_t   mode;         //< fan mode
     uint8_t   duty;         //< fan duty (for manual mode)
-    uint8_t   sensor;       //< fan<->sensor mapping (for linear mode)
+    uint8_t   sensor;       //< fan<->sensor mapping (for automatic modes)
     linear_t  param;        //< linear control parameters
+    points_t  points;       //< multi-point curve
 } fan_config_t;
 
 /**
@@ -110,6 +212,7 @@ typedef struct {
 typedef struct {
     uint8_t       temp_unit;     //< temperature unit (@see temp_unit_t)
     fan_config_t  fan[NUM_FAN];  //< fan configurations
+    uint16_t      period;        //< control period (ms)
 } config_t;
 
 /**
@@ -176,12 +279,79 @@ typedef struct {
 } msg_fan_map_t;
 
 /**
- * @brief Payload for `CMD_FAN_CURVE` message (reply) containing curve points
+ * @brief Payload for `CMD_CURVE_STATE` message (reply)
+ */
+typedef struct {
+    uint8_t  state;         //< generation state (@see curve_state_t)
+    uint8_t  step;          //< no. of duty steps sampled
+    uint8_t  steps;         //< total no. of duty steps
+} msg_curve_state_t;
+
+/**
+ * @brief Payload for `CMD_CURVE_DATA` message (reply) containing curve points
  */
 typedef struct {
     curve_point_t  points[100/CURVE_STEP+1];
 } msg_fan_curve_t;
 
+/**
+ * @brief Payload for `CMD_SUBSCRIBE` message, setting periodic status interval
+ */
+typedef struct {
+    uint16_t  interval;     //< status interval in ms (0: off, min. `SINT_MIN`)
+} msg_subscribe_t;
+
+/**
+ * @brief Payload for `CMD_PERIOD` message, setting control period
+ */
+typedef struct {
+    uint16_t  period;       //< period in ms (`PERIOD_MIN`-`PERIOD_MAX`)
+} msg_period_t;
+
+/**
+ * @brief Payload for `CMD_TIMING` message (reply)
+ *
+ * Statistics cover the control cycles since the previous query (or period
+ * change). Delay is the time from the timer tick making a cycle due until it
+ * runs, jitter the deviation of the time between consecutive cycles from the
+ * period.
+ */
+typedef struct {
+    uint16_t  period;       //< control period (ms)
+    uint16_t  cycles;       //< no. of control cycles run
+    uint16_t  overruns;     //< no. of cycles skipped (previous still due)
+    uint16_t  delay_avg;    //< average delay (us)
+    uint16_t  delay_max;    //< maximum delay (us)
+    int16_t   jitter_min;   //< minimum jitter (us)
+    int16_t   jitter_max;   //< maximum jitter (us)
+} msg_timing_t;
+
+/**
+ * @brief Timing of a firmware phase, @see msg_diag_t
+ */
+typedef struct {
+    uint32_t  count;        //< no. of runs
+    uint16_t  avg;          //< average duration (us)
+    uint16_t  max;          //< maximum duration (us)
+} phase_stats_t;
+
+/**
+ * @brief Payload for `CMD_DIAG` message (reply)
+ *
+ * Phase timings and serial counters cover the time since the previous query,
+ * like `msg_timing_t`. Free stack is the part of RAM above static data that
+ * has never been used by the stack since reset (determined by painting it at
+ * boot), i.e. the headroom left in the worst case seen so far.
+ */
+typedef struct {
+    uint32_t       uptime;      //< time since reset (ms)
+    uint16_t       stack_free;  //< stack never used (bytes)
+    uint16_t       stack_size;  //< RAM available to stack (bytes)
+    uint16_t       dropped;     //< bytes dropped scanning for start of frame
+    uint16_t       errors;      //< frames failing checksum or length check
+    phase_stats_t  phase[NUM_PHASE];    //< timing per phase, @see phase_t
+} msg_diag_t;
+
 /**
  * @brief Payload for `CMD_LINEAR` message, setting linear fan control
  *        parameters
@@ -191,9 +361,108 @@ typedef struct {
     linear_t  param;        //< linear control parameters
 } msg_fan_linear_t;
 
+/**
+ * @brief Payload for `CMD_POINTS` message, setting multi-point fan control
+ *        curve
+ */
+typedef struct {
+    uint8_t   fan;          //< fan no. (counted from zero)
+    points_t  points;       //< multi-point curve
+} msg_fan_points_t;
+
+/**
+ * @brief Payload for `CMD_HISTORY` message (request)
+ */
+typedef struct {
+    uint16_t  seq;          //< cycle no. of first record wanted
+} msg_history_req_t;
+
+/**
+ * @brief Payload header for `CMD_HISTORY` message (reply)
+ *
+ * Followed by `count` records, the first one relative to `base`. If the record
+ * requested is not held (anymore), the reply starts with the oldest record
+ * held. Replies carry as many records as fit into a frame, the following ones
+ * are fetched by requesting `seq + count` until reaching `end`.
+ */
+typedef struct {
+    uint16_t  seq;          //< cycle no. of first record
+    uint16_t  end;          //< cycle no. following newest record
+    uint8_t   count;        //< no. of records
+    uint16_t  period;       //< control period (ms)
+    status_t  base;         //< readings preceding first record (no flags)
+} msg_history_t;
+
+#define HIST_CHUNK  (UINT8_MAX - sizeof(msg_history_t))  // Max. records length
+
+/**
+ * @brief Payload header for `CMD_BATCH` message
+ *
+ * Followed by `len` bytes holding `count` entries, each made of a command byte
+ * and the command's payload. Only commands replying with `msg_result_t` can
+ * be batched (i.e. setting fan mode, duty, mapping, linear parameters,
+ * multi-point curve, status interval, control period and saving/loading).
+ * Entries are executed in order, the reply carries one `msg_result_t` per
+ * entry.
+ */
+typedef struct {
+    uint8_t   count;        //< no. of entries
+    uint8_t   len;          //< length of entries in bytes (max. `BATCH_LEN`)
+} msg_batch_t;
+
+#define BATCH_LEN  (SERIAL_BUFS - sizeof(msg_batch_t))  // Max. batch length
+
 
 #pragma pack(pop)
 
+
+/**
+ * @brief Determine payload length of request
+ *
+ * For `CMD_BATCH` this is the header only, the entries follow.
+ *
+ * @param    command  Command byte, @see cmd_t
+ * @returns  Payload length in bytes, -1 for unknown commands
+ */
+static inline int8_t request_len(uint8_t command)
+{
+    switch (command) {
+        case CMD_VERSION:
+        case CMD_STATUS:
+        case CMD_CONFIG:
+        case CMD_FAN_CURVE:
+        case CMD_CURVE_STATE:
+        case CMD_CURVE_DATA:
+        case CMD_CURVE_STOP:
+        case CMD_SAVE:
+        case CMD_LOAD:
+        case CMD_TIMING:
+        case CMD_DIAG:
+        case CMD_RESET:
+            return 0;
+        case CMD_FAN_MODE:
+            return sizeof(msg_fan_mode_t);
+        case CMD_FAN_DUTY:
+            return sizeof(msg_fan_duty_t);
+        case CMD_FAN_MAP:
+            return sizeof(msg_fan_map_t);
+        case CMD_LINEAR:
+            return sizeof(msg_fan_linear_t);
+        case CMD_POINTS:
+            return sizeof(msg_fan_points_t);
+        case CMD_HISTORY:
+            return sizeof(msg_history_req_t);
+        case CMD_SUBSCRIBE:
+            return sizeof(msg_subscribe_t);
+        case CMD_PERIOD:
+            return sizeof(msg_period_t);
+        case CMD_BATCH:
+            return sizeof(msg_batch_t);
+        default:
+            return -1;
+    }
+}
+
 #endif
 
 
@@ -0,0 +1,57 @@
+/* Generated by thermistor.py from config.h, do not edit.
+ *
+ * This file is part of a project that is distributed under the terms of the MIT
+ * License, see file 'LICENSE'.
+ */
+
+#ifndef _THERMISTOR_H
+#define _THERMISTOR_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#define TMP_LUT_SHIFT  3                      // ADC bits covered by interpolation
+
+// Temperature (*100 deg C) at ADC value (i << TMP_LUT_SHIFT)
+static const uint16_t tmp_lut_c[129] PROGMEM = {
+        0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,    27,   117,   206,   293,   379,   465,
+      550,   633,   717,   799,   881,   963,  1044,  1124,
+     1205,  1284,  1364,  1443,  1523,  1602,  1681,  1759,
+     1838,  1917,  1996,  2075,  2154,  2234,  2313,  2393,
+     2473,  2554,  2634,  2716,  2797,  2880,  2962,  3046,
+     3130,  3215,  3300,  3386,  3474,  3562,  3651,  3741,
+     3832,  3925,  4019,  4114,  4210,  4308,  4408,  4510,
+     4613,  4718,  4826,  4935,  5047,  5162,  5279,  5400,
+     5523,  5650,  5781,  5915,  6054,  6197,  6345,  6499,
+     6659,  6825,  6999,  7180,  7371,  7571,  7782,  8005,
+     8243,  8497,  8769,  9063,  9382,  9732, 10119, 10551,
+    11041, 11607, 12273, 13084, 14113, 15509, 17642, 21916,
+    65534
+};
+
+// Temperature (*100 deg F) at ADC value (i << TMP_LUT_SHIFT)
+static const uint16_t tmp_lut_f[129] PROGMEM = {
+        0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,   184,   418,   643,   861,  1072,  1277,
+     1477,  1671,  1861,  2046,  2228,  2405,  2580,  2751,
+     2920,  3086,  3249,  3411,  3570,  3727,  3883,  4037,
+     4189,  4340,  4490,  4639,  4786,  4933,  5079,  5224,
+     5368,  5512,  5655,  5798,  5941,  6083,  6225,  6367,
+     6509,  6651,  6793,  6935,  7078,  7221,  7364,  7507,
+     7652,  7796,  7942,  8088,  8235,  8383,  8532,  8682,
+     8834,  8986,  9140,  9296,  9453,  9611,  9772,  9934,
+    10098, 10265, 10433, 10605, 10778, 10955, 11135, 11317,
+    11503, 11693, 11886, 12084, 12285, 12492, 12703, 12919,
+    13142, 13370, 13605, 13847, 14097, 14355, 14622, 14899,
+    15186, 15486, 15798, 16124, 16467, 16827, 17207, 17609,
+    18037, 18494, 18984, 19513, 20088, 20718, 21414, 22192,
+    23075, 24092, 25292, 26751, 28603, 31117, 34955, 42648,
+    65534
+};
+
+#endif
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 Alexander Koch
+#
+# This file is part of a project that is distributed under the terms of the MIT
+# License, see file 'LICENSE'.
+
+"""Generate thermistor lookup tables (thermistor.h) for get_temp().
+
+The tables map the 10-bit ADC reading of the sensor voltage divider to the
+temperature multiplied by 100, one entry every 2^SHIFT ADC values. Values in
+between are interpolated linearly by the firmware. The sensor resistor value
+is taken from config.h.
+
+Usage: thermistor.py > thermistor.h
+"""
+
+import math
+import os
+import re
+import sys
+
+# Steinhart-Hart coefficients of standard 10 kOhm NTC thermistors
+A = 1.009249522e-03
+B = 2.378405444e-04
+C = 2.019202697e-07
+
+ADC_MAX = 1023      # 10-bit ADC
+SHIFT = 3           # ADC value bits covered by interpolation
+NCONN = 0xffff      # reserved for disconnected sensors
+
+
+def sensor_resistor():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'config.h')
+    with open(path) as f:
+        match = re.search(r'^#define\s+TMP_R\s+([0-9.eE+-]+)', f.read(), re.M)
+    if not match:
+        sys.exit('TMP_R not found in config.h')
+    return float(match.group(1))
+
+
+def kelvin(adc, tmp_r):
+    adc = min(max(adc, 1), ADC_MAX)
+    r2 = tmp_r * (ADC_MAX / adc - 1.0)
+    if r2 <= 0.0:
+        return math.inf
+    log_r2 = math.log(r2)
+    return 1.0 / (A + B * log_r2 + C * log_r2 ** 3)
+
+
+def table(convert, tmp_r):
+    values = []
+    for i in range((ADC_MAX + 1 >> SHIFT) + 1):
+        t = convert(kelvin(i << SHIFT, tmp_r)) * 100.0
+        values.append(int(round(min(max(t, 0.0), NCONN - 1))))
+    return values
+
+
+def emit(name, comment, values):
+    print('// %s at ADC value (i << TMP_LUT_SHIFT)' % comment)
+    print('static const uint16_t %s[%d] PROGMEM = {' % (name, len(values)))
+    for i in range(0, len(values), 8):
+        line = ', '.join('%5d' % v for v in values[i:i+8])
+        print('    %s%s' % (line, ',' if i + 8 < len(values) else ''))
+    print('};')
+
+
+def main():
+    tmp_r = sensor_resistor()
+
+    print('/* Generated by thermistor.py from config.h, do not edit.')
+    print(' *')
+    print(' * This file is part of a project that is distributed under the '
+          'terms of the MIT')
+    print(" * License, see file 'LICENSE'.")
+    print(' */')
+    print()
+    print('#ifndef _THERMISTOR_H')
+    print('#define _THERMISTOR_H')
+    print()
+    print('#include <stdint.h>')
+    print('#include <avr/pgmspace.h>')
+    print()
+    print('#define TMP_LUT_SHIFT  %-22d // ADC bits covered by interpolation'
+          % SHIFT)
+    print()
+    emit('tmp_lut_c', 'Temperature (*100 deg C)',
+         table(lambda t: t - 273.15, tmp_r))
+    print()
+    emit('tmp_lut_f', 'Temperature (*100 deg F)',
+         table(lambda t: (t - 273.15) * 1.8 + 32.0, tmp_r))
+    print()
+    print('#endif')
+
+
+if __name__ == '__main__':
+    main()
@@ -7,13 +7,98 @@
 #ifndef _LIBFANBOY_H
 #define _LIBFANBOY_H
 
+#include <stddef.h>
+
 #include "firmware/serial.h"
 
+#define FB_SOCKET  "/run/fanboyd.sock"  // default socket of fanboyd
+#define FB_LATENCY_BUCKETS  24          // latency histogram size (1 us..8 s)
+#define FB_STATS_OTHER  (CMD_DIAG + 1)  // stats slot of commands beyond
+#define FB_STATS_CMDS   (FB_STATS_OTHER + 1)    // no. of per-command slots
+
 typedef msg_status_t     fb_status_t;
 typedef msg_version_t    fb_version_t;
 typedef msg_config_t     fb_config_t;
 typedef msg_fan_curve_t  fb_curve_t;
+typedef msg_curve_state_t fb_curve_state_t;
 typedef linear_t         fb_linear_t;
+typedef points_t         fb_points_t;
+typedef msg_timing_t     fb_timing_t;
+typedef msg_diag_t       fb_diag_t;
+
+/**
+ * @brief Readings of a past control cycle, @see fb_history()
+ */
+typedef struct {
+    uint16_t     seq;       //< cycle no.
+    uint32_t     age;       //< time before newest cycle (ms), assuming the
+                            //  current control period throughout
+    fb_status_t  status;    //< fan duties/RPMs and temperatures (no flags)
+} fb_sample_t;
+
+/**
+ * @brief Request statistics of a single command, @see fb_stats_t
+ *
+ * `latency[i]` counts replies received within [2^i, 2^(i+1)) us after
+ * sending the request, the first bucket includes 0 us and the last one all
+ * latencies beyond.
+ */
+typedef struct {
+    uint32_t  requests;     //< requests sent
+    uint32_t  replies;      //< valid replies received
+    uint32_t  timeouts;     //< requests without reply before their deadline
+                            //  (or device disconnected)
+    uint32_t  errors;       //< requests failed otherwise (sending, error or
+                            //  malformed reply)
+    uint64_t  latency_sum;  //< sum of reply latencies (us)
+    uint32_t  latency_max;  //< max. reply latency (us)
+    uint32_t  latency[FB_LATENCY_BUCKETS];  //< reply latency histogram
+} fb_cmd_stats_t;
+
+/**
+ * @brief Communication statistics of a device, @see fb_stats()
+ */
+typedef struct {
+    uint64_t  tx_bytes;     //< bytes sent
+    uint64_t  rx_bytes;     //< bytes received
+    uint32_t  tx_frames;    //< frames sent
+    uint32_t  rx_frames;    //< valid frames received
+    uint32_t  retries;      //< serial I/O calls retried (interrupted, would
+                            //  block, partial)
+    uint32_t  discarded;    //< bytes dropped while scanning for start of frame
+    uint32_t  crc_errors;   //< frames dropped for failing the checksum
+    uint32_t  unmatched;    //< replies to no pending request (e.g. late)
+    uint32_t  events;       //< status events received
+    fb_cmd_stats_t  cmd[FB_STATS_CMDS];     //< per command, by slot, @see
+                                            //  fb_stats_slot()
+} fb_stats_t;
+
+/**
+ * @brief Batch of setting commands, @see fb_batch_init()
+ */
+typedef struct {
+    uint8_t  count;             //< no. of entries
+    uint8_t  len;               //< length of entries in bytes
+    uint8_t  data[BATCH_LEN];   //< entries (command byte and payload)
+} fb_batch_t;
+
+/**
+ * @brief Device handle, @see fb_open()
+ */
+typedef struct fb_device fb_device_t;
+
+/**
+ * @brief Request in flight, @see fb_dev_submit()
+ */
+typedef uint8_t fb_request_t;
+
+/**
+ * @brief Callback receiving periodic status, @see fb_subscribe()
+ *
+ * @param[in] status  Current fan and temperature sensor status
+ * @param     ctx     User pointer passed to `fb_subscribe()`
+ */
+typedef void (*fb_status_cb)(const fb_status_t *status, void *ctx);
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,7 +109,11 @@ extern "C" {
 /**
  * @brief Initialize library and serial communication
  *
- * @param[in] dev  Serial device name
+ * Connects the default device used by all functions not taking a device
+ * handle. @see fb_open() for using several devices at once.
+ *
+ * @param[in] dev  Serial device name, or path of a fanboyd socket (not on
+ *                 Windows)
  *
  * @return true on success, false otherwise
  *
@@ -78,7 +167,7 @@ bool fb_config(fb_config_t *result);
  * @brief Set fan mode
  *
  * @param fan   No. of fan to set mode for (counted by zero)
- * @param mode  Mode to apply (`MODE_MANUAL` or `MODE_LINEAR`)
+ * @param mode  Mode to apply (`MODE_MANUAL`, `MODE_LINEAR` or `MODE_POINTS`)
  *
  * @return true on success, false otherwise
  *
@@ -118,12 +207,71 @@ bool fb_set_map(uint8_t fan, uint8_t sensor);
 /**
  * @brief Generate fan duty <-> RPM correlation data
  *
+ * Starts generation and blocks until finished, which takes about a minute.
+ * @see fb_fan_curve_start() for a non-blocking alternative.
+ *
  * @param[out] result  Buffer to write data to
  *
  * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
  */
 bool fb_fan_curve(fb_curve_t *result);
 
+/**
+ * @brief Start generating fan duty <-> RPM correlation data
+ *
+ * Returns immediately, the device samples the fans in the background and
+ * keeps answering all other requests meanwhile. Use `fb_fan_curve_poll()` to
+ * track progress and `fb_fan_curve_result()` to retrieve the data once
+ * finished.
+ *
+ * @return true on success, false otherwise (e.g. generation already running)
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_fan_curve_start();
+
+/**
+ * @brief Get fan curve generation progress
+ *
+ * @param[out] state  Buffer to write state to, generation has finished once
+ *                    `state->state` is no longer `CURVE_RUNNING`
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_fan_curve_poll(fb_curve_state_t *state);
+
+/**
+ * @brief Get data of latest fan curve generation
+ *
+ * @param[out] result  Buffer to write data to
+ *
+ * @return true on success, false otherwise
+ *
+ * @note The data is only complete if `fb_fan_curve_poll()` reported
+ *       `CURVE_DONE`.
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_fan_curve_result(fb_curve_t *result);
+
+/**
+ * @brief Cancel fan curve generation and restore fan settings
+ *
+ * @return true on success, false otherwise (e.g. generation not running)
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_fan_curve_cancel();
+
 /**
  * @brief Set linear fan control parameters
  *
@@ -137,9 +285,205 @@ bool fb_fan_curve(fb_curve_t *result);
  */
 bool fb_set_linear(uint8_t fan, fb_linear_t *param);
 
+/**
+ * @brief Set multi-point fan control curve
+ *
+ * @param     fan     No. of fan to set curve for (counted by zero)
+ * @param[in] points  Curve points, sorted by strictly increasing temperature
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_set_points(uint8_t fan, fb_points_t *points);
+
+/**
+ * @brief Set control period, i.e. the interval of sampling sensors and fans
+ *        and updating duties
+ *
+ * @param period  Period in ms (`PERIOD_MIN`-`PERIOD_MAX`)
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_set_period(uint16_t period);
+
+/**
+ * @brief Get control loop timing statistics since the previous call
+ *
+ * @param[out] result  Buffer to write statistics to
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_timing(fb_timing_t *result);
+
+/**
+ * @brief Get firmware self-diagnostics since the previous call
+ *
+ * Covers time spent per firmware phase, serial bytes dropped and frames
+ * rejected, stack headroom and uptime, @see msg_diag_t.
+ *
+ * @param[out] result  Buffer to write diagnostics to
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_diag(fb_diag_t *result);
+
+/**
+ * @brief Get readings of past control cycles
+ *
+ * The device keeps a history of the latest control cycles (how many depends
+ * on how much readings change). Samples are fetched in as few requests as
+ * possible, starting with cycle `*seq` or the oldest one held if that is not
+ * held (anymore), up to the newest cycle. Cycle numbers wrap around at 2^16.
+ *
+ * Passing the `*seq` returned by the previous call fetches new cycles only.
+ *
+ * @param[in,out] seq      First cycle to fetch, set to the cycle following
+ *                         the last sample fetched
+ * @param[out]    samples  Buffer for samples, oldest first
+ * @param         max      No. of samples fitting into `samples`
+ * @param[out]    count    No. of samples fetched
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_history(uint16_t *seq, fb_sample_t *samples, size_t max,
+                size_t *count);
+
+/**
+ * @brief Subscribe to periodic status sent by the device
+ *
+ * The device sends its status every `interval` ms on its own until
+ * unsubscribed or the serial port is closed. Status frames are passed to
+ * `callback` by `fb_poll()`, but also while waiting for the reply of any other
+ * request.
+ *
+ * @param interval  Status interval in ms (at least `SINT_MIN`, 0: unsubscribe)
+ * @param callback  Function to call for each status received (may be NULL)
+ * @param ctx       User pointer passed to `callback`
+ *
+ * @return true on success, false otherwise
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_subscribe(uint16_t interval, fb_status_cb callback, void *ctx);
+
+/**
+ * @brief Wait for next periodic status and pass it to the callback
+ *
+ * @param timeout  Maximum time to wait in ms
+ *
+ * @return true if a status was received, false on timeout or error
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_poll(int timeout);
+
+/**
+ * @brief Initialize (i.e. clear) batch of setting commands
+ *
+ * Settings added to a batch using the `fb_batch_*()` functions below are sent
+ * to the device in a single frame by `fb_batch_run()`, saving a round-trip per
+ * setting.
+ *
+ * @param[out] batch  Batch to initialize
+ */
+void fb_batch_init(fb_batch_t *batch);
+
+/**
+ * @brief Add setting fan mode to batch, @see fb_set_mode()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_set_mode(fb_batch_t *batch, uint8_t fan, fan_mode_t mode);
+
+/**
+ * @brief Add setting manual fan duty to batch, @see fb_set_duty()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_set_duty(fb_batch_t *batch, uint8_t fan, uint8_t duty);
+
+/**
+ * @brief Add setting fan <-> sensor mapping to batch, @see fb_set_map()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_set_map(fb_batch_t *batch, uint8_t fan, uint8_t sensor);
+
+/**
+ * @brief Add setting linear fan control parameters to batch,
+ *        @see fb_set_linear()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_set_linear(fb_batch_t *batch, uint8_t fan, fb_linear_t *param);
+
+/**
+ * @brief Add setting multi-point fan control curve to batch,
+ *        @see fb_set_points()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_set_points(fb_batch_t *batch, uint8_t fan, fb_points_t *points);
+
+/**
+ * @brief Add setting control period to batch, @see fb_set_period()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_set_period(fb_batch_t *batch, uint16_t period);
+
+/**
+ * @brief Add saving configuration to EEPROM to batch, @see fb_save()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_save(fb_batch_t *batch);
+
+/**
+ * @brief Add loading configuration from EEPROM to batch, @see fb_load()
+ *
+ * @return true on success, false if batch is full
+ */
+bool fb_batch_load(fb_batch_t *batch);
+
+/**
+ * @brief Send batch to device and apply all settings in order
+ *
+ * @param[in]  batch    Batch to run (left unchanged)
+ * @param[out] results  Buffer for `batch->count` results, one per entry in
+ *                      order of addition (may be NULL)
+ *
+ * @return true if all settings were applied, false otherwise
+ *
+ * @note If the device did not reply, all results are set to `RESULT_ERR`.
+ *
+ * @note In case of failure this function makes an error message available to
+ *       be retrieved using `fb_error()`.
+ */
+bool fb_batch_run(const fb_batch_t *batch, msg_result_t *results);
+
 /**
  * @brief Save current configuration to EEPROM
  *
+ * The device writes EEPROM in the background, `STATUS_SAVING` is set in
+ * `fb_status_t.flags` until the configuration is stored permanently.
+ *
  * @return true on success, false otherwise
  *
  * @note In case of failure this function makes an error message available to
@@ -169,6 +513,208 @@ void fb_reset();
  */
 const char *fb_error();
 
+/**
+ * @brief Check whether the latest request failed in transport
+ *
+ * Distinguishes a device that did not reply at all (not connected, write
+ * failed or timeout) from one that replied with an error.
+ *
+ * @return true if the latest request got no reply, false otherwise
+ */
+bool fb_link_failed();
+
+/**
+ * @brief Get communication statistics
+ *
+ * Counters are kept for every request and frame anyway, so this only copies
+ * them. Counting starts at `fb_init()` or the previous reset.
+ *
+ * @param[out] result  Buffer to write statistics to (may be NULL)
+ * @param      reset   Reset counters after copying
+ *
+ * @return true on success, false otherwise
+ */
+bool fb_stats(fb_stats_t *result, bool reset);
+
+/**
+ * @brief Get slot of command in `fb_stats_t.cmd`
+ *
+ * Commands up to the latest one defined have a slot each, all others (i.e.
+ * `CMD_RESET` and unknown ones) share slot `FB_STATS_OTHER`.
+ *
+ * @param command  Command (`cmd_t`)
+ *
+ * @return Index into `fb_stats_t.cmd`
+ */
+uint8_t fb_stats_slot(uint8_t command);
+
+/**
+ * @brief Set timeout for subsequent requests
+ *
+ * Each request (i.e. sending it and receiving the reply) has to complete
+ * within the timeout, measured from the time it is sent. Changing it between
+ * calls allows different timeouts per request.
+ *
+ * @param timeout  Timeout in microseconds (0: default of 1 s)
+ */
+void fb_set_timeout(uint32_t timeout);
+
+/*
+ * Multi-device API
+ *
+ * Each of the functions below behaves like its counterpart without `dev_`
+ * (e.g. `fb_dev_status()` like `fb_status()`), but acts on the given device
+ * instead of the default one. Devices may be used from different threads in
+ * parallel, requests on the same device are serialized. Error messages are
+ * kept per device and are retrieved using `fb_dev_error()`.
+ */
+
+/**
+ * @brief Connect to device
+ *
+ * @param[in]  dev    Serial device name or fanboyd socket, @see fb_init()
+ * @param[out] error  Set to error message in case of failure (may be NULL)
+ *
+ * @return Device handle on success, NULL otherwise
+ */
+fb_device_t *fb_open(const char *dev, const char **error);
+
+/**
+ * @brief Disconnect from device and free handle
+ *
+ * @param dev  Device handle (may be NULL)
+ */
+void fb_close(fb_device_t *dev);
+
+/**
+ * @brief Get message indicating latest error on device
+ *
+ * @param[in] dev  Device handle
+ *
+ * @return Latest error message
+ */
+const char *fb_dev_error(const fb_device_t *dev);
+
+/**
+ * @brief Check whether the latest request on device failed in transport
+ *
+ * @param[in] dev  Device handle
+ *
+ * @return true if the latest request got no reply, false otherwise
+ */
+bool fb_dev_link_failed(const fb_device_t *dev);
+
+/**
+ * @brief Set timeout for subsequent requests on device, @see fb_set_timeout()
+ */
+void fb_dev_set_timeout(fb_device_t *dev, uint32_t timeout);
+
+bool fb_dev_status(fb_device_t *dev, fb_status_t *result);
+bool fb_dev_version(fb_device_t *dev, fb_version_t *result);
+bool fb_dev_config(fb_device_t *dev, fb_config_t *result);
+bool fb_dev_set_mode(fb_device_t *dev, uint8_t fan, fan_mode_t mode);
+bool fb_dev_set_duty(fb_device_t *dev, uint8_t fan, uint8_t duty);
+bool fb_dev_set_map(fb_device_t *dev, uint8_t fan, uint8_t sensor);
+bool fb_dev_set_linear(fb_device_t *dev, uint8_t fan, fb_linear_t *param);
+bool fb_dev_set_points(fb_device_t *dev, uint8_t fan, fb_points_t *points);
+bool fb_dev_set_period(fb_device_t *dev, uint16_t period);
+bool fb_dev_timing(fb_device_t *dev, fb_timing_t *result);
+bool fb_dev_diag(fb_device_t *dev, fb_diag_t *result);
+bool fb_dev_stats(fb_device_t *dev, fb_stats_t *result, bool reset);
+bool fb_dev_history(fb_device_t *dev, uint16_t *seq, fb_sample_t *samples,
+                    size_t max, size_t *count);
+bool fb_dev_fan_curve(fb_device_t *dev, fb_curve_t *result);
+bool fb_dev_fan_curve_start(fb_device_t *dev);
+bool fb_dev_fan_curve_poll(fb_device_t *dev, fb_curve_state_t *state);
+bool fb_dev_fan_curve_result(fb_device_t *dev, fb_curve_t *result);
+bool fb_dev_fan_curve_cancel(fb_device_t *dev);
+bool fb_dev_batch_run(fb_device_t *dev, const fb_batch_t *batch,
+                      msg_result_t *results);
+bool fb_dev_save(fb_device_t *dev);
+bool fb_dev_load(fb_device_t *dev);
+void fb_dev_reset(fb_device_t *dev);
+
+/**
+ * @brief Subscribe to periodic status sent by device, @see fb_subscribe()
+ *
+ * @note The callback runs while the device is locked and thus must not issue
+ *       requests on the same device.
+ */
+bool fb_dev_subscribe(fb_device_t *dev, uint16_t interval,
+                      fb_status_cb callback, void *ctx);
+bool fb_dev_poll(fb_device_t *dev, int timeout);
+
+/**
+ * @brief Fetch single `CMD_HISTORY` reply, @see fb_history()
+ *
+ * @param      dev    Device handle
+ * @param      seq    First cycle to fetch
+ * @param[out] chunk  Buffer for reply (`msg_history_t` and records), at least
+ *                    `UINT8_MAX` bytes
+ * @param[out] len    Reply length in bytes
+ *
+ * @return true on success, false otherwise
+ */
+bool fb_dev_history_chunk(fb_device_t *dev, uint16_t seq, void *chunk,
+                          size_t *len);
+
+/**
+ * @brief Send request without waiting for the reply
+ *
+ * Allows keeping several requests in flight, e.g. querying status and config
+ * at once. Replies are matched to requests by sequence no. and may be waited
+ * for in any order using `fb_dev_wait()`, which is required for each
+ * submitted request.
+ *
+ * @param      dev         Device handle
+ * @param      command     Command to send, @see cmd_t
+ * @param[in]  payload     Request payload (`msg_*_t`, may be NULL)
+ * @param      len         Request payload length in bytes
+ * @param[out] result      Buffer for reply payload, has to remain valid until
+ *                         the request has been waited for
+ * @param      result_len  Expected reply payload length in bytes
+ * @param[out] request     Request to wait for
+ *
+ * @return true on success, false otherwise (e.g. too many requests in flight)
+ */
+bool fb_dev_submit(fb_device_t *dev, cmd_t command, const void *payload,
+                   size_t len, void *result, size_t result_len,
+                   fb_request_t *request);
+
+/**
+ * @brief Send request with reply of variable length (e.g. `CMD_HISTORY`)
+ *        without waiting for the reply, @see fb_dev_submit()
+ *
+ * @param      dev       Device handle
+ * @param      command   Command to send, @see cmd_t
+ * @param[in]  payload   Request payload (`msg_*_t`, may be NULL)
+ * @param      len       Request payload length in bytes
+ * @param[out] result    Buffer for reply payload, has to remain valid until
+ *                       the request has been waited for
+ * @param      max_len   Max. reply payload length in bytes
+ * @param[out] received  Reply payload length, set once the reply has been
+ *                       received (has to remain valid as `result`)
+ * @param[out] request   Request to wait for
+ *
+ * @return true on success, false otherwise (e.g. too many requests in flight)
+ */
+bool fb_dev_submit_var(fb_device_t *dev, cmd_t command, const void *payload,
+                       size_t len, void *result, size_t max_len,
+                       size_t *received, fb_request_t *request);
+
+/**
+ * @brief Wait for reply to request, @see fb_dev_submit()
+ *
+ * @param dev      Device handle
+ * @param request  Request to wait for
+ *
+ * @return true if the reply has been received, false otherwise
+ *
+ * @note For setting commands, the outcome has to be checked in the
+ *       `msg_result_t` received.
+ */
+bool fb_dev_wait(fb_device_t *dev, fb_request_t request);
+
 #ifdef __cplusplus
 }
 #endif
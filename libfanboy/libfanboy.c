@@ -6,6 +6,11 @@
 
 #include "libfanboy.h"
 #include "serial.h"
+#include "firmware/crc8.h"
+#include "firmware/history.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -13,169 +18,911 @@
 #include <Windows.h>
 #endif
 
-static const int RETRIES       = 2;       // retry count for regular receive
-static const int CURVE_RETRIES = 200;     // retry count for curve sampling
+static const int CURVE_POLL_MS = 1000;    // fan curve progress poll interval
+static const uint32_t DEF_TIMEOUT_US = 1000000;  // default request timeout
 
-const char *error = NULL;
+#define MAX_PENDING  8                    // max. no. of requests in flight
+#define FRAME_LEN    (sizeof(header_t) + UINT8_MAX + 1)  // max. frame length
+#define RX_LEN       (4 * FRAME_LEN)      // receive buffer size
 
-static bool query(cmd_t command, const void *payload, size_t payload_len,
-                  void *result, size_t result_len)
+/**
+ * @brief Request sent, but not yet waited for
+ */
+typedef struct {
+    uint8_t      seq;           // sequence no. (0: slot unused)
+    uint8_t      cmd;           // command sent
+    bool         done;          // reply received (or failed)
+    uint64_t     sent;          // time sent, @see serial_time()
+    uint64_t     deadline;      // time to give up waiting
+    void        *result;        // buffer for reply payload
+    size_t       len;           // expected reply payload length
+    size_t      *received;      // reply length (NULL: exactly `len` expected,
+                                // otherwise up to `len`)
+    const char  *error;         // error message if failed, NULL otherwise
+} pending_t;
+
+struct fb_device {
+    serial_t      *port;        // serial interface (NULL if not connected)
+    const char    *error;       // latest error message
+    bool           link_failed; // latest request failed in transport
+    fb_status_cb   status_cb;   // status subscription callback
+    void          *status_ctx;
+    uint32_t       timeout;     // request timeout in us (0: default)
+    uint8_t        seq;         // latest sequence no. used
+    pending_t      pending[MAX_PENDING];
+    uint8_t        rx[RX_LEN];  // receive buffer
+    size_t         rx_start;    // start of unprocessed data in `rx`
+    size_t         rx_len;      // length of unprocessed data
+    fb_stats_t     stats;       // counters since connecting or reset
+    uint32_t       retries;     // serial retries at reset
+};
+
+// device used by the functions not taking a handle
+static fb_device_t default_dev = { .port = NULL };
+
+static bool send_frame(fb_device_t *dev, uint8_t seq, cmd_t command,
+                       const void *payload, size_t len, uint64_t deadline)
 {
-    error = NULL;
-
-    // send header
-    header_t header = { .sof = SOF, .cmd = command };
-    if (!serial_send(&header, sizeof(header)))
+    uint8_t frame[FRAME_LEN];
+    header_t header = { .sof = SOF, .seq = seq, .cmd = command, .len = len };
+    memcpy(frame, &header, sizeof(header));
+    if (len)
+        memcpy(frame + sizeof(header), payload, len);
+    frame[sizeof(header) + len] = crc8(frame, sizeof(header) + len);
+
+    // single write for the whole frame
+    if (!serial_send(dev->port, frame, sizeof(header) + len + 1, deadline,
+                     &dev->error))
         return false;
 
-    // send payload (if any)
-    if (payload)
-        if (!serial_send(payload, payload_len))
-            return false;
+    dev->stats.tx_bytes += sizeof(header) + len + 1;
+    dev->stats.tx_frames++;
 
-    // scan for reply header
-    header.sof = 0;
-    while (header.sof != SOF &&
-           serial_receive(&header.sof, sizeof(header.sof), RETRIES)) {}
-    if (header.sof != SOF)
-        return false;
+    return true;
+}
 
-    if (!serial_receive(&header.cmd, sizeof(header.cmd), RETRIES))
-        return false;
-    if (header.cmd != command) {
-        error = "protocol error";
+/**
+ * @brief Receive more data into `dev->rx`
+ *
+ * Reads as much as available at once. Unprocessed data is moved to the
+ * start of the buffer when running out of space at its end, so frames are
+ * always contiguous and can be parsed in place.
+ */
+static bool receive_more(fb_device_t *dev, uint64_t deadline)
+{
+    if (dev->rx_start + dev->rx_len == RX_LEN) {
+        memmove(dev->rx, dev->rx + dev->rx_start, dev->rx_len);
+        dev->rx_start = 0;
+    }
+
+    uint8_t *end = dev->rx + dev->rx_start + dev->rx_len;
+    size_t len = serial_read(dev->port, end, RX_LEN - (end - dev->rx),
+                             deadline, &dev->error);
+    dev->rx_len += len;
+    dev->stats.rx_bytes += len;
+
+    return len > 0;
+}
+
+/**
+ * @brief Find next valid frame in `dev->rx`, receiving data as needed
+ *
+ * The frame starts at `dev->rx + dev->rx_start` and remains there until
+ * consumed by `dispatch_frame()`. A frame failing the checksum is dropped by
+ * its start-of-frame byte only, so that a frame starting within its bytes is
+ * still found. Incomplete frames are kept on timeout.
+ *
+ * @param deadline  Time to give up at, @see serial_time()
+ *
+ * @return Frame length on success, 0 otherwise
+ */
+static size_t receive_frame(fb_device_t *dev, uint64_t deadline)
+{
+    while (true) {
+        // drop data preceding start of frame
+        uint8_t *frame = dev->rx + dev->rx_start;
+        uint8_t *sof = memchr(frame, SOF, dev->rx_len);
+        size_t skip = sof ? (size_t)(sof - frame) : dev->rx_len;
+        dev->rx_start += skip;
+        dev->rx_len -= skip;
+        dev->stats.discarded += skip;
+        frame += skip;
+        if (dev->rx_len == 0)
+            dev->rx_start = 0;
+
+        size_t need = sizeof(header_t);
+        if (dev->rx_len >= need)
+            need += ((header_t *)frame)->len + 1;
+        if (dev->rx_len < need) {
+            if (!receive_more(dev, deadline))
+                return 0;
+            continue;
+        }
+
+        if (frame[need-1] == crc8(frame, need-1))
+            return need;
+
+        // false start of frame, rescan from next byte
+        dev->rx_start++;
+        dev->rx_len--;
+        dev->stats.discarded++;
+        dev->stats.crc_errors++;
+    }
+}
+
+static pending_t *pending_find(fb_device_t *dev, uint8_t seq)
+{
+    for (int i=0; i<MAX_PENDING; i++)
+        if (dev->pending[i].seq == seq)
+            return &dev->pending[i];
+
+    return NULL;
+}
+
+/**
+ * @brief Account reply latency of request, @see fb_cmd_stats_t
+ */
+static void latency_add(fb_cmd_stats_t *stats, uint64_t latency)
+{
+    uint8_t bucket = 0;
+    while (bucket < FB_LATENCY_BUCKETS - 1 && latency >> (bucket + 1))
+        bucket++;
+
+    stats->replies++;
+    stats->latency[bucket]++;
+    stats->latency_sum += latency;
+    if (latency > stats->latency_max)
+        stats->latency_max = latency > UINT32_MAX ? UINT32_MAX : latency;
+}
+
+/**
+ * @brief Pass frame received to status callback or matching request
+ *
+ * Replies not matching any pending request (e.g. late replies to requests
+ * that already timed out) are dropped.
+ */
+static void dispatch_frame(fb_device_t *dev, size_t frame_len)
+{
+    header_t *header = (header_t *)(dev->rx + dev->rx_start);
+    const uint8_t *payload = dev->rx + dev->rx_start + sizeof(header_t);
+
+    dev->stats.rx_frames++;
+    if (header->seq == 0) {
+        dev->stats.events++;
+        if (header->cmd == CMD_STATUS_EVENT &&
+                header->len == sizeof(fb_status_t) && dev->status_cb) {
+            fb_status_t status;
+            memcpy(&status, payload, sizeof(status));
+            dev->status_cb(&status, dev->status_ctx);
+        }
+    } else {
+        pending_t *req = pending_find(dev, header->seq);
+        if (req && !req->done) {
+            fb_cmd_stats_t *stats = &dev->stats.cmd[fb_stats_slot(req->cmd)];
+            req->done = true;
+            if (header->cmd == req->cmd && (header->len == req->len ||
+                    (req->received && header->len <= req->len))) {
+                memcpy(req->result, payload, header->len);
+                if (req->received)
+                    *req->received = header->len;
+                latency_add(stats, serial_time() - req->sent);
+            } else {
+                stats->errors++;
+                if (header->cmd == CMD_CHECKSUM)
+                    req->error = "device reported checksum error";
+                else if (header->cmd == CMD_INVALID)
+                    req->error = "device reported invalid command";
+                else
+                    req->error = "protocol error";
+            }
+        } else {
+            dev->stats.unmatched++;
+        }
+    }
+
+    dev->rx_start += frame_len;
+    dev->rx_len -= frame_len;
+}
+
+static fb_request_t request_submit(fb_device_t *dev, cmd_t command,
+                           const void *payload, size_t payload_len,
+                           void *result, size_t result_len, size_t *received)
+{
+    dev->error = NULL;
+    dev->link_failed = false;
+    if (!dev->port) {
+        dev->error = "not initialized";
+        dev->link_failed = true;
+        return 0;
+    }
+    if (payload_len > UINT8_MAX || result_len > UINT8_MAX) {
+        dev->error = "payload too long";
+        return 0;
+    }
+
+    serial_lock(dev->port);
+
+    pending_t *req = pending_find(dev, 0);
+    if (req == NULL) {
+        serial_unlock(dev->port);
+        dev->error = "too many pending requests";
+        return 0;
+    }
+
+    // skip 0 and sequence no. still pending
+    do {
+        dev->seq++;
+    } while (dev->seq == 0 || pending_find(dev, dev->seq));
+
+    uint32_t timeout = dev->timeout ? dev->timeout : DEF_TIMEOUT_US;
+    uint64_t now = serial_time();
+    *req = (pending_t){ .seq = dev->seq, .cmd = command, .result = result,
+                        .len = result_len, .received = received,
+                        .sent = now, .deadline = now + timeout };
+    fb_request_t id = req->seq;
+    fb_cmd_stats_t *stats = &dev->stats.cmd[fb_stats_slot(command)];
+    stats->requests++;
+    if (!send_frame(dev, req->seq, command, payload, payload_len,
+                    req->deadline)) {
+        stats->errors++;
+        dev->link_failed = true;
+        req->seq = 0;
+        id = 0;
+    }
+
+    serial_unlock(dev->port);
+
+    return id;
+}
+
+static bool request_wait(fb_device_t *dev, fb_request_t id)
+{
+    dev->error = NULL;
+    dev->link_failed = false;
+    if (!dev->port) {
+        dev->error = "not initialized";
+        dev->link_failed = true;
         return false;
     }
 
-    // receive reply payload
-    if (!serial_receive(result, result_len, RETRIES))
+    serial_lock(dev->port);
+
+    pending_t *req = id ? pending_find(dev, id) : NULL;
+    if (req == NULL) {
+        serial_unlock(dev->port);
+        dev->error = "unknown request";
         return false;
+    }
 
-    return true;
+    // replies to other requests are stored for those
+    while (!req->done) {
+        size_t len = receive_frame(dev, req->deadline);
+        if (len == 0) {
+            req->done = true;
+            req->error = dev->error;
+            dev->link_failed = true;
+            dev->stats.cmd[fb_stats_slot(req->cmd)].timeouts++;
+        } else {
+            dispatch_frame(dev, len);
+        }
+    }
+
+    dev->error = req->error;
+    req->seq = 0;
+
+    serial_unlock(dev->port);
+
+    return dev->error == NULL;
 }
 
-static bool simple_query(cmd_t command, const void *payload, size_t len)
+static bool query(fb_device_t *dev, cmd_t command, const void *payload,
+                  size_t payload_len, void *result, size_t result_len)
+{
+    fb_request_t id = request_submit(dev, command, payload, payload_len, result,
+                             result_len, NULL);
+
+    return id && request_wait(dev, id);
+}
+
+static bool simple_query(fb_device_t *dev, cmd_t command, const void *payload,
+                         size_t len)
 {
     msg_result_t result;
 
-    if (!query(command, payload, len, &result, sizeof(result)))
+    if (!query(dev, command, payload, len, &result, sizeof(result)))
         return false;
     if (result.retult != RESULT_OK) {
-        error = "device reported error";
+        dev->error = "device reported error";
         return false;
     }
 
     return true;
 }
 
-bool fb_init(const char *dev)
+static void sleep_ms(uint32_t ms)
 {
-    return serial_open(dev);
+#ifndef WIN32
+    usleep(ms * 1000);
+#else
+    Sleep(ms);
+#endif
 }
 
-void fb_exit()
+fb_device_t *fb_open(const char *dev, const char **error)
+{
+    const char *err = NULL;
+    serial_t *port = serial_open(dev, &err);
+    if (port == NULL) {
+        if (error)
+            *error = err;
+        return NULL;
+    }
+
+    fb_device_t *device = calloc(1, sizeof(fb_device_t));
+    if (device == NULL) {
+        serial_close(port);
+        if (error)
+            *error = "out of memory";
+        return NULL;
+    }
+    device->port = port;
+
+    return device;
+}
+
+void fb_close(fb_device_t *dev)
 {
-    serial_close();
+    if (dev == NULL)
+        return;
+
+    serial_close(dev->port);
+    free(dev);
 }
 
-const char *fb_error()
+const char *fb_dev_error(const fb_device_t *dev)
 {
-    return error;
+    return dev->error;
 }
 
-bool fb_status(fb_status_t *result)
+bool fb_dev_link_failed(const fb_device_t *dev)
 {
-    return query(CMD_STATUS, NULL, 0, result, sizeof(fb_status_t));
+    return dev->link_failed;
 }
 
-bool fb_version(fb_version_t *result)
+void fb_dev_set_timeout(fb_device_t *dev, uint32_t timeout)
 {
-    return query(CMD_VERSION, NULL, 0, result, sizeof(fb_version_t));
+    dev->timeout = timeout;
 }
 
-bool fb_config(fb_config_t *result)
+bool fb_dev_status(fb_device_t *dev, fb_status_t *result)
 {
-    return query(CMD_CONFIG, NULL, 0, result, sizeof(fb_config_t));
+    return query(dev, CMD_STATUS, NULL, 0, result, sizeof(fb_status_t));
 }
 
-bool fb_set_mode(uint8_t fan, fan_mode_t mode)
+bool fb_dev_version(fb_device_t *dev, fb_version_t *result)
+{
+    return query(dev, CMD_VERSION, NULL, 0, result, sizeof(fb_version_t));
+}
+
+bool fb_dev_config(fb_device_t *dev, fb_config_t *result)
+{
+    return query(dev, CMD_CONFIG, NULL, 0, result, sizeof(fb_config_t));
+}
+
+bool fb_dev_set_mode(fb_device_t *dev, uint8_t fan, fan_mode_t mode)
 {
     msg_fan_mode_t msg = { .fan = fan, .mode = mode };
 
-    return simple_query(CMD_FAN_MODE, &msg, sizeof(msg));
+    return simple_query(dev, CMD_FAN_MODE, &msg, sizeof(msg));
 }
 
-bool fb_set_duty(uint8_t fan, uint8_t duty)
+bool fb_dev_set_duty(fb_device_t *dev, uint8_t fan, uint8_t duty)
 {
     msg_fan_duty_t msg = { .fan = fan, .duty = duty };
 
-    return simple_query(CMD_FAN_DUTY, &msg, sizeof(msg));
+    return simple_query(dev, CMD_FAN_DUTY, &msg, sizeof(msg));
 }
 
-bool fb_set_map(uint8_t fan, uint8_t sensor)
+bool fb_dev_set_map(fb_device_t *dev, uint8_t fan, uint8_t sensor)
 {
     msg_fan_map_t msg = { .fan = fan, .sensor = sensor };
 
-    return simple_query(CMD_FAN_MAP, &msg, sizeof(msg));
+    return simple_query(dev, CMD_FAN_MAP, &msg, sizeof(msg));
 }
 
-bool fb_set_linear(uint8_t fan, fb_linear_t *param)
+bool fb_dev_set_linear(fb_device_t *dev, uint8_t fan, fb_linear_t *param)
 {
     msg_fan_linear_t msg = { .fan = fan, .param = *param };
 
-    return simple_query(CMD_LINEAR, &msg, sizeof(msg));
+    return simple_query(dev, CMD_LINEAR, &msg, sizeof(msg));
 }
 
-bool fb_fan_curve(fb_curve_t *result)
+bool fb_dev_set_points(fb_device_t *dev, uint8_t fan, fb_points_t *points)
 {
-    error = NULL;
+    msg_fan_points_t msg = { .fan = fan, .points = *points };
+
+    return simple_query(dev, CMD_POINTS, &msg, sizeof(msg));
+}
+
+bool fb_dev_set_period(fb_device_t *dev, uint16_t period)
+{
+    msg_period_t msg = { .period = period };
+
+    return simple_query(dev, CMD_PERIOD, &msg, sizeof(msg));
+}
+
+bool fb_dev_timing(fb_device_t *dev, fb_timing_t *result)
+{
+    return query(dev, CMD_TIMING, NULL, 0, result, sizeof(fb_timing_t));
+}
+
+bool fb_dev_diag(fb_device_t *dev, fb_diag_t *result)
+{
+    return query(dev, CMD_DIAG, NULL, 0, result, sizeof(fb_diag_t));
+}
 
-    // send header
-    header_t header = { .sof = SOF, .cmd = CMD_FAN_CURVE };
-    if (!serial_send(&header, sizeof(header)))
+uint8_t fb_stats_slot(uint8_t command)
+{
+    return command < FB_STATS_OTHER ? command : FB_STATS_OTHER;
+}
+
+bool fb_dev_stats(fb_device_t *dev, fb_stats_t *result, bool reset)
+{
+    dev->error = NULL;
+    if (!dev->port) {
+        dev->error = "not initialized";
         return false;
+    }
 
-    // wait for fan curve to be sampled
-    uint16_t delay_ms = (100/CURVE_STEP + 1) * (CURVE_SDELAY +
-                        (CURVE_SMPNUM - 1) * CURVE_SMPDEL);
-#ifndef WIN32
-    usleep(delay_ms * 1000);
-#else
-    Sleep(delay_ms);
-#endif
+    serial_lock(dev->port);
+
+    uint32_t retries = serial_retries(dev->port);
+    dev->stats.retries = retries - dev->retries;
+    if (result)
+        memcpy(result, &dev->stats, sizeof(fb_stats_t));
+    if (reset) {
+        memset(&dev->stats, 0, sizeof(fb_stats_t));
+        dev->retries = retries;
+    }
 
-    // scan for reply header, extended timeout due to unknown sampling delay
-    header.sof = 0;
-    while (header.sof != SOF &&
-           serial_receive(&header.sof, sizeof(header.sof), CURVE_RETRIES)) {}
-    if (header.sof != SOF)
+    serial_unlock(dev->port);
+
+    return true;
+}
+
+bool fb_dev_history_chunk(fb_device_t *dev, uint16_t seq, void *chunk,
+                          size_t *len)
+{
+    msg_history_req_t msg = { .seq = seq };
+    fb_request_t id = request_submit(dev, CMD_HISTORY, &msg, sizeof(msg),
+                                     chunk, UINT8_MAX, len);
+    if (!id || !request_wait(dev, id))
         return false;
 
-    if (!serial_receive(&header.cmd, sizeof(header.cmd), RETRIES))
+    if (*len < sizeof(msg_history_t)) {
+        dev->error = "protocol error";
         return false;
-    if (header.cmd != CMD_FAN_CURVE) {
-        error = "protocol error";
+    }
+
+    return true;
+}
+
+bool fb_dev_history(fb_device_t *dev, uint16_t *seq, fb_sample_t *samples,
+                    size_t max, size_t *count)
+{
+    *count = 0;
+    while (*count < max) {
+        uint8_t chunk[UINT8_MAX];
+        size_t len;
+        if (!fb_dev_history_chunk(dev, *seq, chunk, &len))
+            return false;
+
+        msg_history_t msg;
+        memcpy(&msg, chunk, sizeof(msg));
+        const uint8_t *data = chunk + sizeof(msg);
+        len -= sizeof(msg);
+
+        // records are relative to their predecessor
+        fb_status_t values = msg.base;
+        size_t pos = 0;
+        uint8_t i = 0;
+        for (; i < msg.count && *count < max; i++) {
+            if (pos >= len)
+                break;
+            pos += hist_decode(data, len, pos, &values);
+            if (pos > len)
+                break;
+
+            fb_sample_t *sample = &samples[(*count)++];
+            sample->seq = msg.seq + i;
+            sample->age = (uint32_t)(uint16_t)(msg.end - 1 - sample->seq) *
+                          msg.period;
+            sample->status = values;
+        }
+        if (i < msg.count && *count < max) {
+            dev->error = "protocol error";
+            return false;
+        }
+
+        *seq = msg.seq + i;
+        if (*seq == msg.end || msg.count == 0)
+            break;
+    }
+
+    return true;
+}
+
+bool fb_dev_fan_curve_start(fb_device_t *dev)
+{
+    return simple_query(dev, CMD_FAN_CURVE, NULL, 0);
+}
+
+bool fb_dev_fan_curve_poll(fb_device_t *dev, fb_curve_state_t *state)
+{
+    return query(dev, CMD_CURVE_STATE, NULL, 0, state,
+                 sizeof(fb_curve_state_t));
+}
+
+bool fb_dev_fan_curve_result(fb_device_t *dev, fb_curve_t *result)
+{
+    return query(dev, CMD_CURVE_DATA, NULL, 0, result, sizeof(fb_curve_t));
+}
+
+bool fb_dev_fan_curve_cancel(fb_device_t *dev)
+{
+    return simple_query(dev, CMD_CURVE_STOP, NULL, 0);
+}
+
+bool fb_dev_fan_curve(fb_device_t *dev, fb_curve_t *result)
+{
+    if (!fb_dev_fan_curve_start(dev))
+        return false;
+
+    fb_curve_state_t state = { .state = CURVE_RUNNING };
+    while (state.state == CURVE_RUNNING) {
+        sleep_ms(CURVE_POLL_MS);
+        if (!fb_dev_fan_curve_poll(dev, &state))
+            return false;
+    }
+    if (state.state != CURVE_DONE) {
+        dev->error = "fan curve generation cancelled";
         return false;
     }
 
-    // receive reply payload
-    if (!serial_receive(result, sizeof(fb_curve_t), RETRIES))
+    return fb_dev_fan_curve_result(dev, result);
+}
+
+void fb_batch_init(fb_batch_t *batch)
+{
+    batch->count = 0;
+    batch->len = 0;
+}
+
+static bool batch_add(fb_batch_t *batch, cmd_t command, const void *payload,
+                      size_t len)
+{
+    if (batch->len + 1 + len > BATCH_LEN || batch->count >= BATCH_LEN)
+        return false;
+
+    batch->data[batch->len++] = command;
+    if (len)
+        memcpy(batch->data + batch->len, payload, len);
+    batch->len += len;
+    batch->count++;
+
+    return true;
+}
+
+bool fb_batch_set_mode(fb_batch_t *batch, uint8_t fan, fan_mode_t mode)
+{
+    msg_fan_mode_t msg = { .fan = fan, .mode = mode };
+
+    return batch_add(batch, CMD_FAN_MODE, &msg, sizeof(msg));
+}
+
+bool fb_batch_set_duty(fb_batch_t *batch, uint8_t fan, uint8_t duty)
+{
+    msg_fan_duty_t msg = { .fan = fan, .duty = duty };
+
+    return batch_add(batch, CMD_FAN_DUTY, &msg, sizeof(msg));
+}
+
+bool fb_batch_set_map(fb_batch_t *batch, uint8_t fan, uint8_t sensor)
+{
+    msg_fan_map_t msg = { .fan = fan, .sensor = sensor };
+
+    return batch_add(batch, CMD_FAN_MAP, &msg, sizeof(msg));
+}
+
+bool fb_batch_set_linear(fb_batch_t *batch, uint8_t fan, fb_linear_t *param)
+{
+    msg_fan_linear_t msg = { .fan = fan, .param = *param };
+
+    return batch_add(batch, CMD_LINEAR, &msg, sizeof(msg));
+}
+
+bool fb_batch_set_points(fb_batch_t *batch, uint8_t fan, fb_points_t *points)
+{
+    msg_fan_points_t msg = { .fan = fan, .points = *points };
+
+    return batch_add(batch, CMD_POINTS, &msg, sizeof(msg));
+}
+
+bool fb_batch_set_period(fb_batch_t *batch, uint16_t period)
+{
+    msg_period_t msg = { .period = period };
+
+    return batch_add(batch, CMD_PERIOD, &msg, sizeof(msg));
+}
+
+bool fb_batch_save(fb_batch_t *batch)
+{
+    return batch_add(batch, CMD_SAVE, NULL, 0);
+}
+
+bool fb_batch_load(fb_batch_t *batch)
+{
+    return batch_add(batch, CMD_LOAD, NULL, 0);
+}
+
+bool fb_dev_batch_run(fb_device_t *dev, const fb_batch_t *batch,
+                      msg_result_t *results)
+{
+    uint8_t frame[sizeof(msg_batch_t) + BATCH_LEN];
+    msg_batch_t head = { .count = batch->count, .len = batch->len };
+    memcpy(frame, &head, sizeof(head));
+    memcpy(frame + sizeof(head), batch->data, batch->len);
+
+    msg_result_t reply[BATCH_LEN];
+    bool ret = query(dev, CMD_BATCH, frame, sizeof(head) + batch->len, reply,
+                     batch->count * sizeof(msg_result_t));
+    if (!ret)
+        memset(reply, RESULT_ERR, sizeof(reply));
+    if (results)
+        memcpy(results, reply, batch->count * sizeof(msg_result_t));
+    if (!ret)
         return false;
 
+    for (int i=0; i<batch->count; i++) {
+        if (reply[i].retult != RESULT_OK) {
+            dev->error = "device reported error";
+            return false;
+        }
+    }
+
     return true;
 }
 
+bool fb_dev_subscribe(fb_device_t *dev, uint16_t interval,
+                      fb_status_cb callback, void *ctx)
+{
+    // events may arrive before the reply already
+    dev->status_cb = callback;
+    dev->status_ctx = ctx;
+
+    msg_subscribe_t msg = { .interval = interval };
+
+    return simple_query(dev, CMD_SUBSCRIBE, &msg, sizeof(msg));
+}
+
+bool fb_dev_submit(fb_device_t *dev, cmd_t command, const void *payload,
+                   size_t len, void *result, size_t result_len,
+                   fb_request_t *request)
+{
+    *request = request_submit(dev, command, payload, len, result, result_len,
+                              NULL);
+
+    return *request != 0;
+}
+
+bool fb_dev_submit_var(fb_device_t *dev, cmd_t command, const void *payload,
+                       size_t len, void *result, size_t max_len,
+                       size_t *received, fb_request_t *request)
+{
+    *request = request_submit(dev, command, payload, len, result, max_len,
+                              received);
+
+    return *request != 0;
+}
+
+bool fb_dev_wait(fb_device_t *dev, fb_request_t request)
+{
+    return request_wait(dev, request);
+}
+
+bool fb_dev_poll(fb_device_t *dev, int timeout)
+{
+    dev->error = NULL;
+    if (!dev->port) {
+        dev->error = "not initialized";
+        return false;
+    }
+
+    uint64_t deadline = serial_time() + (uint64_t)timeout * 1000;
+
+    // replies to pending requests are stored for those
+    serial_lock(dev->port);
+    bool event = false;
+    while (!event) {
+        size_t len = receive_frame(dev, deadline);
+        if (len == 0)
+            break;
+        header_t *header = (header_t *)(dev->rx + dev->rx_start);
+        event = header->seq == 0 && header->cmd == CMD_STATUS_EVENT;
+        dispatch_frame(dev, len);
+    }
+    serial_unlock(dev->port);
+
+    return event;
+}
+
+bool fb_dev_save(fb_device_t *dev)
+{
+    return simple_query(dev, CMD_SAVE, NULL, 0);
+}
+
+bool fb_dev_load(fb_device_t *dev)
+{
+    return simple_query(dev, CMD_LOAD, NULL, 0);
+}
+
+void fb_dev_reset(fb_device_t *dev)
+{
+    simple_query(dev, CMD_RESET, NULL, 0);
+}
+
+bool fb_init(const char *dev)
+{
+    default_dev.error = NULL;
+    if (default_dev.port) {
+        default_dev.error = "already initialized";
+        return false;
+    }
+
+    default_dev.port = serial_open(dev, &default_dev.error);
+
+    return default_dev.port != NULL;
+}
+
+void fb_exit()
+{
+    if (default_dev.port)
+        serial_close(default_dev.port);
+    memset(&default_dev, 0, sizeof(default_dev));
+}
+
+const char *fb_error()
+{
+    return fb_dev_error(&default_dev);
+}
+
+bool fb_link_failed()
+{
+    return fb_dev_link_failed(&default_dev);
+}
+
+void fb_set_timeout(uint32_t timeout)
+{
+    fb_dev_set_timeout(&default_dev, timeout);
+}
+
+bool fb_status(fb_status_t *result)
+{
+    return fb_dev_status(&default_dev, result);
+}
+
+bool fb_version(fb_version_t *result)
+{
+    return fb_dev_version(&default_dev, result);
+}
+
+bool fb_config(fb_config_t *result)
+{
+    return fb_dev_config(&default_dev, result);
+}
+
+bool fb_set_mode(uint8_t fan, fan_mode_t mode)
+{
+    return fb_dev_set_mode(&default_dev, fan, mode);
+}
+
+bool fb_set_duty(uint8_t fan, uint8_t duty)
+{
+    return fb_dev_set_duty(&default_dev, fan, duty);
+}
+
+bool fb_set_map(uint8_t fan, uint8_t sensor)
+{
+    return fb_dev_set_map(&default_dev, fan, sensor);
+}
+
+bool fb_set_linear(uint8_t fan, fb_linear_t *param)
+{
+    return fb_dev_set_linear(&default_dev, fan, param);
+}
+
+bool fb_set_points(uint8_t fan, fb_points_t *points)
+{
+    return fb_dev_set_points(&default_dev, fan, points);
+}
+
+bool fb_set_period(uint16_t period)
+{
+    return fb_dev_set_period(&default_dev, period);
+}
+
+bool fb_timing(fb_timing_t *result)
+{
+    return fb_dev_timing(&default_dev, result);
+}
+
+bool fb_diag(fb_diag_t *result)
+{
+    return fb_dev_diag(&default_dev, result);
+}
+
+bool fb_stats(fb_stats_t *result, bool reset)
+{
+    return fb_dev_stats(&default_dev, result, reset);
+}
+
+bool fb_history(uint16_t *seq, fb_sample_t *samples, size_t max,
+                size_t *count)
+{
+    return fb_dev_history(&default_dev, seq, samples, max, count);
+}
+
+bool fb_fan_curve_start()
+{
+    return fb_dev_fan_curve_start(&default_dev);
+}
+
+bool fb_fan_curve_poll(fb_curve_state_t *state)
+{
+    return fb_dev_fan_curve_poll(&default_dev, state);
+}
+
+bool fb_fan_curve_result(fb_curve_t *result)
+{
+    return fb_dev_fan_curve_result(&default_dev, result);
+}
+
+bool fb_fan_curve_cancel()
+{
+    return fb_dev_fan_curve_cancel(&default_dev);
+}
+
+bool fb_fan_curve(fb_curve_t *result)
+{
+    return fb_dev_fan_curve(&default_dev, result);
+}
+
+bool fb_batch_run(const fb_batch_t *batch, msg_result_t *results)
+{
+    return fb_dev_batch_run(&default_dev, batch, results);
+}
+
+bool fb_subscribe(uint16_t interval, fb_status_cb callback, void *ctx)
+{
+    return fb_dev_subscribe(&default_dev, interval, callback, ctx);
+}
+
+bool fb_poll(int timeout)
+{
+    return fb_dev_poll(&default_dev, timeout);
+}
+
 bool fb_save()
 {
-    return simple_query(CMD_SAVE, NULL, 0);
+    return fb_dev_save(&default_dev);
 }
 
 bool fb_load()
 {
-    return simple_query(CMD_LOAD, NULL, 0);
+    return fb_dev_load(&default_dev);
 }
 
 void fb_reset()
 {
-    simple_query(CMD_RESET, NULL, 0);
+    fb_dev_reset(&default_dev);
 }
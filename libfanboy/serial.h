@@ -22,41 +22,96 @@ extern "C" {
 #endif
 
 
+/**
+ * @brief Serial interface handle (platform-specific)
+ */
+typedef struct serial serial_t;
+
 /**
  * @brief Open serial interface, set connection parameters (baud rate, parity,
  *        etc.)
  *
- * @param[in] dev  Serial device to use
+ * @param[in]  dev    Serial device to use
+ * @param[out] error  Set to error message in case of failure
  *
- * @return true on success, false otherwise
+ * @return Serial interface handle on success, NULL otherwise
  */
-bool serial_open(const char *dev);
+serial_t *serial_open(const char *dev, const char **error);
 
 /**
- * @brief Close serial interface
+ * @brief Close serial interface and free handle
+ *
+ * @param port  Serial interface handle
  */
-void serial_close();
+void serial_close(serial_t *port);
+
+/**
+ * @brief Acquire exclusive access to serial interface
+ *
+ * Held for a whole request/reply exchange, so that concurrent requests on the
+ * same interface do not interleave.
+ *
+ * @param port  Serial interface handle
+ */
+void serial_lock(serial_t *port);
+
+/**
+ * @brief Release exclusive access to serial interface, @see serial_lock()
+ *
+ * @param port  Serial interface handle
+ */
+void serial_unlock(serial_t *port);
+
+/**
+ * @brief Get current time of a monotonic clock
+ *
+ * @return Time in microseconds (arbitrary epoch), used for deadlines
+ */
+uint64_t serial_time();
 
 /**
  * @brief Send data via serial interface
  *
- * @param[in] data  Pointer to data buffer to send
- * @param     len   Number of bytes to read from buffer
+ * @param      port      Serial interface handle
+ * @param[in]  data      Pointer to data buffer to send
+ * @param      len       Number of bytes to read from buffer
+ * @param      deadline  Time to give up at, @see serial_time()
+ * @param[out] error     Set to error message in case of failure
  *
  * @return true on success, false otherwise
  */
-bool serial_send(const void *data, size_t len);
+bool serial_send(serial_t *port, const void *data, size_t len,
+                 uint64_t deadline, const char **error);
+
+/**
+ * @brief Receive available data from serial interface
+ *
+ * Waits for at least one byte to arrive and returns all data available up to
+ * the buffer size, i.e. one call usually receives a whole reply. Fails
+ * immediately if the device has been disconnected.
+ *
+ * @param      port      Serial interface handle
+ * @param[out] data      Pointer to data buffer
+ * @param      len       Size of data buffer
+ * @param      deadline  Time to give up at, @see serial_time()
+ * @param[out] error     Set to error message in case of failure
+ *
+ * @return Number of bytes received, 0 on timeout or error
+ */
+size_t serial_read(serial_t *port, void *data, size_t len, uint64_t deadline,
+                   const char **error);
 
 /**
- * @brief Receive data from serial interface
+ * @brief Get no. of I/O calls retried so far
+ *
+ * Counts reads and writes repeated because they were interrupted, would have
+ * blocked or transferred only part of the data.
  *
- * @param[out] data     Pointer to data buffer
- * @param      len      Number of bytes to receive
- * @param      retries  Retries per timed-out read() call
+ * @param port  Serial interface handle
  *
- * @return true if requested amount of bytes has been received, false otherwise
+ * @return No. of retries since opening
  */
-bool serial_receive(void *data, size_t len, int retries);
+uint32_t serial_retries(const serial_t *port);
 
 #ifdef __cplusplus
 }
@@ -4,96 +4,196 @@
  * License, see file 'LICENSE'.
  */
 
+#include <poll.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include "serial.h"
 
 
-extern const char *error;
-
 static const speed_t  BAUD   = B57600;
-static const uint8_t  TMO_CS = 5;
 
-static int fd = -1;
-pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+struct serial {
+    int              fd;
+    bool             socket;    // connected to fanboyd instead of tty
+    uint32_t         retries;   // I/O calls retried, @see serial_retries()
+    pthread_mutex_t  lock;
+};
 
 
-bool serial_send(const void *data, size_t len)
+void serial_lock(serial_t *port)
 {
-    pthread_mutex_lock(&fd_lock);
+    pthread_mutex_lock(&port->lock);
+}
 
-    size_t nwritten = 0;
-    ssize_t ret = 0;
-    while (nwritten < len &&
-           (ret = write(fd, (char *)data+nwritten, len-nwritten)) > 0)
-        nwritten += ret;
+void serial_unlock(serial_t *port)
+{
+    pthread_mutex_unlock(&port->lock);
+}
 
-    if (ret < 0)
-        error = strerror(errno);
+uint32_t serial_retries(const serial_t *port)
+{
+    return port->retries;
+}
 
-    pthread_mutex_unlock(&fd_lock);
+uint64_t serial_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return nwritten == len;
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-bool serial_receive(void *data, size_t len, int retries)
+/**
+ * @brief Wait until `fd` is ready for `events` or `deadline` has passed
+ *
+ * @return Events returned by poll(), 0 on timeout, -1 on error (errno set)
+ */
+static int wait_fd(int fd, short events, uint64_t deadline)
 {
-    pthread_mutex_lock(&fd_lock);
-
-    size_t nread = 0;
-    ssize_t ret = 0;
-    int try = 0;
-    while (nread < len && try <= retries) {
-        ret = read(fd, (char *)data+nread, len-nread);
-        if (ret < 0) {
-            // I/O error
-            error = strerror(errno);
-            break;
-        } else if (ret == 0) {
-            // no data
-            try++;
-        } else {
-            // successful read (may be partial)
-            try = 0;
-            nread += ret;
+    while (true) {
+        // round up, so that poll() does not return before the deadline
+        uint64_t now = serial_time();
+        uint64_t remaining = now < deadline ? (deadline - now + 999) / 1000 : 0;
+        struct pollfd pfd = { .fd = fd, .events = events };
+        int ret = poll(&pfd, 1, remaining > INT32_MAX ? INT32_MAX :
+                                (int)remaining);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0 && serial_time() < deadline)
+            continue;
+        if (ret <= 0)
+            return ret;
+
+        return pfd.revents;
+    }
+}
+
+bool serial_send(serial_t *port, const void *data, size_t len,
+                 uint64_t deadline, const char **error)
+{
+    size_t nwritten = 0;
+    while (nwritten < len) {
+        ssize_t ret;
+        if (port->socket)
+            ret = send(port->fd, (char *)data+nwritten, len-nwritten,
+                       MSG_NOSIGNAL);
+        else
+            ret = write(port->fd, (char *)data+nwritten, len-nwritten);
+        if (ret > 0) {
+            nwritten += ret;
+            if (nwritten < len)
+                port->retries++;
+            continue;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+            *error = strerror(errno);
+            return false;
+        }
+        port->retries++;
+
+        int ready = wait_fd(port->fd, POLLOUT, deadline);
+        if (ready <= 0) {
+            *error = ready == 0 ? "timeout sending data" : strerror(errno);
+            return false;
+        }
+        if (ready & (POLLHUP | POLLERR | POLLNVAL)) {
+            *error = "device disconnected";
+            return false;
         }
     }
 
-    if (ret == 0)
-        error = "timeout receiving data";
+    return true;
+}
 
-    pthread_mutex_unlock(&fd_lock);
+size_t serial_read(serial_t *port, void *data, size_t len, uint64_t deadline,
+                   const char **error)
+{
+    while (true) {
+        // waiting first saves a read() when no data has arrived yet
+        int ready = wait_fd(port->fd, POLLIN, deadline);
+        if (ready <= 0) {
+            *error = ready == 0 ? "timeout receiving data" : strerror(errno);
+            return 0;
+        }
+        if (!(ready & POLLIN) && ready & (POLLHUP | POLLERR | POLLNVAL)) {
+            // device unplugged
+            *error = "device disconnected";
+            return 0;
+        }
 
-    return nread == len;
+        ssize_t ret = read(port->fd, data, len);
+        if (ret > 0)
+            return ret;
+        if (ret == 0 && port->socket) {
+            // end of file, i.e. daemon gone
+            *error = "device disconnected";
+            return 0;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+            // I/O error
+            *error = strerror(errno);
+            return 0;
+        }
+        port->retries++;
+    }
 }
 
 
 
-bool serial_open(const char *dev)
+static bool socket_open(serial_t *port, const char *path, const char **error)
 {
-    pthread_mutex_lock(&fd_lock);
-    bool ret = false;
-    
-    if (fd >= 0) {
-        error = "already initialized";
-        goto cleanup;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+
+    port->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (port->fd < 0 ||
+            connect(port->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            fcntl(port->fd, F_SETFL, O_NONBLOCK) != 0) {
+        *error = strerror(errno);
+        serial_close(port);
+        return false;
     }
-    
-    fd = open(dev, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
-        error = strerror(errno);
+
+    return true;
+}
+
+serial_t *serial_open(const char *dev, const char **error)
+{
+    serial_t *port = malloc(sizeof(serial_t));
+    if (port == NULL) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    pthread_mutex_init(&port->lock, NULL);
+    port->retries = 0;
+
+    struct stat st;
+    port->socket = stat(dev, &st) == 0 && S_ISSOCK(st.st_mode);
+    if (port->socket)
+        return socket_open(port, dev, error) ? port : NULL;
+
+    port->fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (port->fd < 0) {
+        *error = strerror(errno);
         goto cleanup;
     }
 	usleep(10000);
     
     struct termios tty;
-    if (tcgetattr(fd, &tty) != 0) {
-        error = strerror(errno);
+    if (tcgetattr(port->fd, &tty) != 0) {
+        *error = strerror(errno);
         goto cleanup;
     }
     struct termios old = tty;
@@ -108,37 +208,32 @@ bool serial_open(const char *dev)
 
 	cfmakeraw(&tty);
 
-    // set non-canonical mode: blocking read and timeout
+    // set non-canonical mode, timeouts are handled using poll()
     tty.c_cc[VMIN]  = 0;
-    tty.c_cc[VTIME] = TMO_CS;
+    tty.c_cc[VTIME] = 0;
 
     // apply only if changes
     if (memcmp(&tty, &old, sizeof(struct termios)) != 0) {
-        if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-            error = strerror(errno);
+        if (tcsetattr(port->fd, TCSANOW, &tty) != 0) {
+            *error = strerror(errno);
             goto cleanup;
         }
     }    
-    tcflush(fd, TCIOFLUSH);
+    tcflush(port->fd, TCIOFLUSH);
 	usleep(10000);
 
-    ret = true;
+    return port;
     
 cleanup:
-    pthread_mutex_unlock(&fd_lock);
+    serial_close(port);
 
-    return ret;
+    return NULL;
 }
 
-void serial_close()
+void serial_close(serial_t *port)
 {
-    pthread_mutex_lock(&fd_lock);
-    
-    if (fd >= 0) {
-        close(fd);
-        fd = -1;
-    }
-    
-    pthread_mutex_unlock(&fd_lock);
+    if (port->fd >= 0)
+        close(port->fd);
+    pthread_mutex_destroy(&port->lock);
+    free(port);
 }
-
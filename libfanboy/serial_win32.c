@@ -16,95 +16,148 @@
 
 #include <Windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <synchapi.h>
 
 #include "serial.h"
 
 #define ERR_LEN 1024
 
-extern const char *error;
+// open errors outlive the handle
+static char open_err[ERR_LEN];
 
-static HANDLE fd = INVALID_HANDLE_VALUE;
-static SRWLOCK fd_lock = SRWLOCK_INIT;
-static char err_string[ERR_LEN];
-static const int SERIAL_TIMEOUT = 50;
-static const int SERIAL_MULT = 20;
+struct serial {
+    HANDLE   fd;
+    SRWLOCK  lock;
+    uint32_t retries;   // I/O calls retried, @see serial_retries()
+    char     err_string[ERR_LEN];
+};
 
 
-bool serial_send(const void *data, size_t len)
+void serial_lock(serial_t *port)
 {
-    AcquireSRWLockExclusive(&fd_lock);
+    AcquireSRWLockExclusive(&port->lock);
+}
 
-    DWORD written = 0;
-    if (WriteFile(fd, data, len, &written, NULL) == FALSE)
-    {
-        snprintf(err_string, ERR_LEN-1, "Failed to write to serial port (%lu)",
-                 GetLastError());
-        error = err_string;
+void serial_unlock(serial_t *port)
+{
+    ReleaseSRWLockExclusive(&port->lock);
+}
+
+uint32_t serial_retries(const serial_t *port)
+{
+    return port->retries;
+}
+
+uint64_t serial_time()
+{
+    static LARGE_INTEGER freq = { 0 };
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart / freq.QuadPart * 1000000 +
+           now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+/**
+ * @brief Set read and write timeouts to time remaining until `deadline`
+ *
+ * @return false if the deadline has passed already or on error
+ */
+static bool set_timeouts(serial_t *port, uint64_t deadline)
+{
+    uint64_t now = serial_time();
+    if (now >= deadline)
         return false;
-    }
 
-    ReleaseSRWLockExclusive(&fd_lock);
+    // round up, so that the timeout does not expire before the deadline
+    uint64_t remaining = (deadline - now + 999) / 1000;
+    DWORD tmo = remaining >= MAXDWORD ? MAXDWORD - 1 : (DWORD)remaining;
 
-    return written == len;
+    // reads return as soon as any data is available, @see serial_read()
+    COMMTIMEOUTS timeouts = { 0 };
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = tmo;
+    timeouts.WriteTotalTimeoutConstant = tmo;
+
+    return SetCommTimeouts(port->fd, &timeouts) != FALSE;
 }
 
-bool serial_receive(void *data, size_t len, int retries)
+bool serial_send(serial_t *port, const void *data, size_t len,
+                 uint64_t deadline, const char **error)
 {
-    AcquireSRWLockExclusive(&fd_lock);
-
-    size_t nread = 0;
-    DWORD ret = 0;
-    int try = 0;
-    while (nread < len && try <= retries) {
-        if (!ReadFile(fd, (char *)data+nread, len-nread, &ret, NULL)) {
-            // I/O error
-            snprintf(err_string, ERR_LEN-1,
-                     "Failed to read from serial port (%lu)", GetLastError());
-            error = err_string;
-            break;
-        } else if (ret == 0) {
-            // no data
-            try++;
-        } else {
-            // successful read (may be partial)
-            try = 0;
-            nread += ret;
+    size_t nwritten = 0;
+    while (nwritten < len) {
+        DWORD ret = 0;
+        if (!set_timeouts(port, deadline)) {
+            *error = "timeout sending data";
+            return false;
         }
+        if (!WriteFile(port->fd, (const char *)data+nwritten, len-nwritten,
+                       &ret, NULL)) {
+            snprintf(port->err_string, ERR_LEN-1,
+                     "Failed to write to serial port (%lu)", GetLastError());
+            *error = port->err_string;
+            return false;
+        }
+        nwritten += ret;
+        if (nwritten < len)
+            port->retries++;
     }
 
-    if (ret == 0)
-        error = "timeout receiving data";
-
-    ReleaseSRWLockExclusive(&fd_lock);
-
-    return nread == len;
+    return true;
 }
 
-bool serial_open(const char *dev)
+size_t serial_read(serial_t *port, void *data, size_t len, uint64_t deadline,
+                   const char **error)
 {
-    AcquireSRWLockExclusive(&fd_lock);
-    bool ret = false;
+    while (true) {
+        DWORD ret = 0;
+        if (!set_timeouts(port, deadline)) {
+            *error = "timeout receiving data";
+            return 0;
+        }
+        if (!ReadFile(port->fd, data, len, &ret, NULL)) {
+            // I/O error, e.g. device unplugged
+            snprintf(port->err_string, ERR_LEN-1,
+                     "Failed to read from serial port (%lu)", GetLastError());
+            *error = port->err_string;
+            return 0;
+        }
+        if (ret > 0)
+            return ret;
+        port->retries++;
+    }
+}
 
-    if (fd != INVALID_HANDLE_VALUE) {
-        error = "already initialized";
-        goto cleanup;
+serial_t *serial_open(const char *dev, const char **error)
+{
+    serial_t *port = malloc(sizeof(serial_t));
+    if (port == NULL) {
+        *error = "Out of memory";
+        return NULL;
     }
+    InitializeSRWLock(&port->lock);
+    port->retries = 0;
 
-    fd = CreateFile(dev, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-                    0, NULL);
-    if (fd == INVALID_HANDLE_VALUE) {
-        snprintf(err_string, ERR_LEN-1, "Failed to open serial port (%lu)",
+    port->fd = CreateFile(dev, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                          OPEN_EXISTING, 0, NULL);
+    if (port->fd == INVALID_HANDLE_VALUE) {
+        snprintf(open_err, ERR_LEN-1, "Failed to open serial port (%lu)",
                  GetLastError());
-        error = err_string;
+        *error = open_err;
         goto cleanup;
     }
 
     DCB params = { 0 };
     params.DCBlength = sizeof(params);
-    if (GetCommState(fd, &params) == FALSE)
+    if (GetCommState(port->fd, &params) == FALSE)
     {
-        error = "Failed to read serial port state";
+        *error = "Failed to read serial port state";
         goto cleanup;
     }
 
@@ -116,42 +169,31 @@ bool serial_open(const char *dev)
     params.StopBits = ONESTOPBIT;
 
     if (memcmp(&params, &old_params, sizeof(DCB))) {
-        if (SetCommState(fd, &params) == FALSE) {
-            error = "Failed to set serial port parameters";
+        if (SetCommState(port->fd, &params) == FALSE) {
+            *error = "Failed to set serial port parameters";
             goto cleanup;
         }
     }
 
-    COMMTIMEOUTS timeouts = { 0 };
-    timeouts.ReadIntervalTimeout = SERIAL_TIMEOUT;
-    timeouts.ReadTotalTimeoutConstant = SERIAL_TIMEOUT;
-    timeouts.ReadTotalTimeoutMultiplier = SERIAL_MULT;
-    timeouts.WriteTotalTimeoutConstant = SERIAL_TIMEOUT;
-    timeouts.WriteTotalTimeoutMultiplier = SERIAL_MULT;
-
-    if (SetCommTimeouts(fd, &timeouts) == FALSE)
+    // timeouts are set per call, @see set_timeouts()
+    if (!set_timeouts(port, serial_time() + 1000000))
     {
-        error = "Failed to set serial timeouts";
+        *error = "Failed to set serial timeouts";
         goto cleanup;
     }
 
-    ret = true;
+    return port;
 
 cleanup:
-    ReleaseSRWLockExclusive(&fd_lock);
+    serial_close(port);
 
-    return ret;
+    return NULL;
 }
 
-void serial_close()
+void serial_close(serial_t *port)
 {
-    AcquireSRWLockExclusive(&fd_lock);
-
-    if (fd != INVALID_HANDLE_VALUE) {
-        CloseHandle(fd);
-        fd = INVALID_HANDLE_VALUE;
-    }
-
-    ReleaseSRWLockExclusive(&fd_lock);
+    if (port->fd != INVALID_HANDLE_VALUE)
+        CloseHandle(port->fd);
+    free(port);
 }
 